@@ -0,0 +1,544 @@
+#define _GNU_SOURCE     // mremap, O_DIRECT, sync_file_range
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+
+#define WINDOW_CHUNK_SIZE (256 * 1024)     // must be a multiple of the page size
+#define WINDOW_CHUNK_CLUSTERS (WINDOW_CHUNK_SIZE / CLUSTER_SIZE)
+#define BLOCK_SIZE 4096                    // pread backend I/O unit, fine for O_DIRECT on any device
+#define BLOCK_CLUSTERS (BLOCK_SIZE / CLUSTER_SIZE)
+#define DEFAULT_CACHE_MB 16
+
+// ---------------------------------------------------------------------------------------------
+// mmap backend: the whole image is one shared mapping, optionally with a bounded resident window
+
+typedef struct MmapStorage{
+    Storage s;                  // s.base is the mapping
+    long size;
+    int fd;
+
+    // Windowed mode: only the most recently used chunks of the data region are kept resident
+    int window_slots;           // how many chunks may be resident, 0 if windowed mode is off
+    int* window_chunk;          // chunk held by each slot, -1 if the slot is empty
+    int* slot_prev;             // slots are kept in a list from the most to the least recently used
+    int* slot_next;
+    int window_head;
+    int window_tail;
+    int* chunk_slot;            // slot holding each chunk, -1 if the chunk is not resident
+    int chunk_count;
+    pthread_mutex_t window_lock;
+} MmapStorage;
+
+// Drops chunk held by <slot> from memory. The mapping is shared, so dirty pages just go back to the page
+// cache, and a pointer to the chunk still around will simply fault it in again
+static void window_evict(MmapStorage* m, int slot){
+    int chunk = m->window_chunk[slot];
+    long offset = (long)chunk * WINDOW_CHUNK_SIZE;
+    long len = m->size - offset < WINDOW_CHUNK_SIZE ? m->size - offset : WINDOW_CHUNK_SIZE;
+
+    madvise((char*)m->s.base + offset, len, MADV_DONTNEED);
+    posix_fadvise(m->fd, offset, len, POSIX_FADV_DONTNEED);     // clean pages can leave the page cache too
+
+    m->chunk_slot[chunk] = -1;
+    m->window_chunk[slot] = -1;
+}
+
+static void window_unlink(MmapStorage* m, int slot){
+    if(m->slot_prev[slot] != -1) m->slot_next[m->slot_prev[slot]] = m->slot_next[slot];
+    else m->window_head = m->slot_next[slot];
+    if(m->slot_next[slot] != -1) m->slot_prev[m->slot_next[slot]] = m->slot_prev[slot];
+    else m->window_tail = m->slot_prev[slot];
+}
+
+static void window_push(MmapStorage* m, int slot){
+    m->slot_prev[slot] = -1;
+    m->slot_next[slot] = m->window_head;
+    if(m->window_head != -1) m->slot_prev[m->window_head] = slot;
+    else m->window_tail = slot;
+    m->window_head = slot;
+}
+
+// Marks the chunk holding <cluster> as used, evicting the least recently used one if the window is full
+static void window_touch(MmapStorage* m, int cluster){
+    int chunk = cluster / WINDOW_CHUNK_CLUSTERS;
+
+    // Chunks holding boot sector, FAT or checksums stay resident for good
+    if((long)chunk * WINDOW_CHUNK_CLUSTERS < ((FileSystem*)m->s.base)->data_start || chunk >= m->chunk_count) return;
+
+    pthread_mutex_lock(&m->window_lock);
+    int slot = m->chunk_slot[chunk];
+    if(slot == -1){
+        // Empty slots start at the tail, so they're picked before any eviction happens
+        slot = m->window_tail;
+        if(m->window_chunk[slot] != -1) window_evict(m, slot);
+        m->window_chunk[slot] = chunk;
+        m->chunk_slot[chunk] = slot;
+    }
+    if(slot != m->window_head){
+        window_unlink(m, slot);
+        window_push(m, slot);
+    }
+    pthread_mutex_unlock(&m->window_lock);
+}
+
+// Keeps the chunk table in sync with the size of the mapping
+static void window_resize(MmapStorage* m){
+    int new_count = (m->size + WINDOW_CHUNK_SIZE - 1) / WINDOW_CHUNK_SIZE;
+    m->chunk_slot = realloc(m->chunk_slot, new_count * sizeof(int));
+    assert(m->chunk_slot && "realloc failed");
+    for(int i = m->chunk_count; i < new_count; i++) m->chunk_slot[i] = -1;
+    m->chunk_count = new_count;
+
+    // No readahead and no fault-around: we only want in memory what we actually touch
+    madvise(m->s.base, m->size, MADV_RANDOM);
+}
+
+static void window_open(MmapStorage* m, int window_mb){
+    m->window_slots = (long)window_mb * 1024 * 1024 / WINDOW_CHUNK_SIZE;
+    if(m->window_slots < 1) m->window_slots = 1;
+
+    m->window_chunk = malloc(m->window_slots * sizeof(int));
+    m->slot_prev = malloc(m->window_slots * sizeof(int));
+    m->slot_next = malloc(m->window_slots * sizeof(int));
+    assert(m->window_chunk && m->slot_prev && m->slot_next && "malloc failed");
+    m->window_head = m->window_tail = -1;
+    for(int i = 0; i < m->window_slots; i++){
+        m->window_chunk[i] = -1;
+        window_push(m, i);
+    }
+
+    m->chunk_count = 0;
+    window_resize(m);
+}
+
+static void window_close(MmapStorage* m){
+    if(!m->window_slots) return;
+    free(m->window_chunk);
+    free(m->slot_prev);
+    free(m->slot_next);
+    free(m->chunk_slot);
+}
+
+static Storage* mmap_open(int fd, long size, const BackendOptions* options){
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) return NULL;
+
+    MmapStorage* m = calloc(1, sizeof(MmapStorage));
+    assert(m && "malloc failed");
+    m->s.backend = &mmap_backend;
+    m->s.base = base;
+    m->fd = fd;
+    m->size = size;
+    pthread_mutex_init(&m->window_lock, NULL);
+
+    if(options && options->window_mb > 0)
+        window_open(m, options->window_mb);
+    return &m->s;
+}
+
+static char* mmap_cluster(Storage* s, int cluster){
+    MmapStorage* m = (MmapStorage*)s;
+    if(m->window_slots) window_touch(m, cluster);
+    return (char*)s->base + (long)CLUSTER_SIZE * cluster;
+}
+
+// Writes through the mapping already land in the page cache
+static void mmap_dirty(Storage* s, int cluster){
+}
+
+static void mmap_read(Storage* s, int cluster, char* buf){
+    memcpy(buf, mmap_cluster(s, cluster), CLUSTER_SIZE);
+}
+
+static void mmap_release(Storage* s){
+}
+
+static void mmap_flush(Storage* s){
+    assert(!msync(s->base, ((MmapStorage*)s)->size, MS_SYNC) && "msync failed");
+}
+
+static void* mmap_resize(Storage* s, long new_size){
+    MmapStorage* m = (MmapStorage*)s;
+    assert(!ftruncate(m->fd, new_size) && "ftruncate failed");
+    s->base = mremap(s->base, m->size, new_size, MREMAP_MAYMOVE);
+    assert(s->base != MAP_FAILED && "mremap failed");
+    m->size = new_size;
+    if(m->window_slots) window_resize(m);
+    return s->base;
+}
+
+// Pages written through the mapping are already in the page cache, we just get the kernel started on them
+static void mmap_writeback(Storage* s, int first, int count){
+    sync_file_range(((MmapStorage*)s)->fd, (long)first * CLUSTER_SIZE, (long)count * CLUSTER_SIZE, SYNC_FILE_RANGE_WRITE);
+}
+
+static void mmap_close(Storage* s){
+    MmapStorage* m = (MmapStorage*)s;
+    window_close(m);
+    assert(!munmap(s->base, m->size) && "munmap failed");
+    pthread_mutex_destroy(&m->window_lock);
+    free(m);
+}
+
+const Backend mmap_backend = {
+    "mmap", mmap_open, mmap_cluster, mmap_dirty, mmap_read, mmap_release, mmap_flush, mmap_resize, mmap_writeback, mmap_close, 1
+};
+
+// ---------------------------------------------------------------------------------------------
+// pread backend: explicit I/O in 4 KB blocks through our own cache, dirty blocks are written in sorted batches
+
+typedef struct CacheBlock{
+    char* buf;              // BLOCK_SIZE bytes, aligned for O_DIRECT
+    int block;
+    int dirty;
+    struct CacheBlock* prev;    // cached blocks are kept in a list from the most to the least recently used
+    struct CacheBlock* next;
+} CacheBlock;
+
+typedef struct PreadStorage{
+    Storage s;                  // s.base is the pinned area
+    int io_fd;                  // the descriptor fs.c opened
+    int direct_fd;              // same file opened with O_DIRECT, -1 if not requested
+    long file_size;
+    int block_count;            // blocks covering the file
+    int full_blocks;            // blocks entirely inside the file, only these can go through O_DIRECT
+    char* pinned;               // boot sector, FAT, checksums (and the data clusters sharing their last block)
+    int pinned_blocks;
+    char* pinned_dirty;
+    CacheBlock** blocks;        // by block number, NULL if not cached
+    int cached_count;
+    int cache_limit;            // most blocks kept in the cache
+    CacheBlock* cache_slots;    // cache_limit blocks, their buffers are carved out of a single allocation
+    char* cache_pool;
+    CacheBlock* free_slots;     // unused slots, chained through next
+    CacheBlock* lru_head;
+    CacheBlock* lru_tail;
+    int* dirty_list;            // blocks waiting to be written
+    int dirty_count;
+    pthread_mutex_t cache_lock;
+} PreadStorage;
+
+// Moves <count> blocks starting at <first> between the file and <iov> (one iovec per block)
+static void transfer(PreadStorage* p, int writing, int first, int count, struct iovec* iov){
+    // Full blocks go through O_DIRECT when we have it, a few at a time
+    int direct = p->direct_fd == -1 ? 0 : (p->full_blocks - first < count ? p->full_blocks - first : count);
+    if(direct < 0) direct = 0;
+    for(int done = 0; done < direct; ){
+        int n = direct - done < IOV_MAX ? direct - done : IOV_MAX;
+        off_t offset = (off_t)(first + done) * BLOCK_SIZE;
+        ssize_t moved = writing ? pwritev(p->direct_fd, iov + done, n, offset) : preadv(p->direct_fd, iov + done, n, offset);
+        assert(moved == (ssize_t)n * BLOCK_SIZE && "direct I/O failed");
+        done += n;
+    }
+
+    // Everything else (only the last block of the file can be partial) goes through the page cache
+    for(int i = direct; i < count; i++){
+        off_t offset = (off_t)(first + i) * BLOCK_SIZE;
+        long len = p->file_size - offset < BLOCK_SIZE ? p->file_size - offset : BLOCK_SIZE;
+        if(writing) assert(pwrite(p->io_fd, iov[i].iov_base, len, offset) == len && "pwrite failed");
+        else{
+            assert(pread(p->io_fd, iov[i].iov_base, len, offset) == len && "pread failed");
+            memset((char*)iov[i].iov_base + len, 0, BLOCK_SIZE - len);
+        }
+    }
+}
+
+static char* block_buffer(PreadStorage* p, int block){
+    return block < p->pinned_blocks ? p->pinned + (long)block * BLOCK_SIZE : p->blocks[block]->buf;
+}
+
+static int compare_int(const void* a, const void* b){
+    return *(const int*)a - *(const int*)b;
+}
+
+// Writes every dirty block, consecutive blocks in a single call. Must hold cache_lock
+static void write_dirty(PreadStorage* p){
+    if(!p->dirty_count) return;
+    qsort(p->dirty_list, p->dirty_count, sizeof(int), compare_int);
+
+    struct iovec* iov = malloc(p->dirty_count * sizeof(struct iovec));
+    assert(iov && "malloc failed");
+    int i = 0;
+    while(i < p->dirty_count){
+        int run = 1;
+        while(i + run < p->dirty_count && p->dirty_list[i + run] == p->dirty_list[i] + run) run++;
+        for(int k = 0; k < run; k++){
+            int block = p->dirty_list[i + k];
+            iov[k].iov_base = block_buffer(p, block);
+            iov[k].iov_len = BLOCK_SIZE;
+            if(block < p->pinned_blocks) p->pinned_dirty[block] = 0;
+            else p->blocks[block]->dirty = 0;
+        }
+        transfer(p, 1, p->dirty_list[i], run, iov);
+        i += run;
+    }
+    free(iov);
+    p->dirty_count = 0;
+}
+
+static void lru_unlink(PreadStorage* p, CacheBlock* cached){
+    if(cached->prev) cached->prev->next = cached->next;
+    else p->lru_head = cached->next;
+    if(cached->next) cached->next->prev = cached->prev;
+    else p->lru_tail = cached->prev;
+}
+
+static void lru_push(PreadStorage* p, CacheBlock* cached){
+    cached->prev = NULL;
+    cached->next = p->lru_head;
+    if(p->lru_head) p->lru_head->prev = cached;
+    else p->lru_tail = cached;
+    p->lru_head = cached;
+}
+
+// Drops least recently used blocks until at most <target> are cached. A dirty one gets every dirty block
+// written first, in one sorted batch. Must hold cache_lock
+static void cache_trim(PreadStorage* p, int target){
+    while(p->cached_count > target && p->lru_tail){
+        CacheBlock* victim = p->lru_tail;
+        if(victim->dirty) write_dirty(p);
+        lru_unlink(p, victim);
+        p->blocks[victim->block] = NULL;
+        victim->next = p->free_slots;
+        p->free_slots = victim;
+        p->cached_count--;
+    }
+}
+
+static Storage* pread_open(int fd, long size, const BackendOptions* options){
+    FileSystem superblock;
+    if(size < CLUSTER_SIZE || pread(fd, &superblock, sizeof(superblock), 0) != sizeof(superblock)) return NULL;
+    if(superblock.data_start <= 0 || (long)superblock.data_start * CLUSTER_SIZE > size) return NULL;
+
+    PreadStorage* p = calloc(1, sizeof(PreadStorage));
+    assert(p && "malloc failed");
+    p->s.backend = &pread_backend;
+    p->io_fd = fd;
+    p->file_size = size;
+    p->block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    p->full_blocks = size / BLOCK_SIZE;
+    p->pinned_blocks = (superblock.data_start + BLOCK_CLUSTERS - 1) / BLOCK_CLUSTERS;
+    if(p->pinned_blocks > p->block_count) p->pinned_blocks = p->block_count;
+    pthread_mutex_init(&p->cache_lock, NULL);
+
+    p->direct_fd = -1;
+    if(options && options->direct){
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        p->direct_fd = open(path, O_RDWR | O_DIRECT);
+        if(p->direct_fd < 0) printf("open: O_DIRECT not available here, using the page cache\n");
+    }
+
+    int cache_mb = options && options->cache_mb > 0 ? options->cache_mb : DEFAULT_CACHE_MB;
+    p->cache_limit = (long)cache_mb * 1024 * 1024 / BLOCK_SIZE;
+    if(p->cache_limit < 1) p->cache_limit = 1;
+
+    assert(!posix_memalign((void**)&p->pinned, BLOCK_SIZE, (size_t)p->pinned_blocks * BLOCK_SIZE) && "malloc failed");
+    p->pinned_dirty = calloc(p->pinned_blocks, 1);
+    p->blocks = calloc(p->block_count, sizeof(CacheBlock*));
+    p->dirty_list = malloc(p->block_count * sizeof(int));
+    assert(p->pinned_dirty && p->blocks && p->dirty_list && "malloc failed");
+
+    // Pages of the pool only become resident once a block lands on them
+    assert(!posix_memalign((void**)&p->cache_pool, BLOCK_SIZE, (size_t)p->cache_limit * BLOCK_SIZE) && "malloc failed");
+    p->cache_slots = malloc(p->cache_limit * sizeof(CacheBlock));
+    assert(p->cache_slots && "malloc failed");
+    for(int i = p->cache_limit - 1; i >= 0; i--){
+        p->cache_slots[i].buf = p->cache_pool + (long)i * BLOCK_SIZE;
+        p->cache_slots[i].next = p->free_slots;
+        p->free_slots = &p->cache_slots[i];
+    }
+
+    struct iovec* iov = malloc(p->pinned_blocks * sizeof(struct iovec));
+    assert(iov && "malloc failed");
+    for(int i = 0; i < p->pinned_blocks; i++){
+        iov[i].iov_base = p->pinned + (long)i * BLOCK_SIZE;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    transfer(p, 0, 0, p->pinned_blocks, iov);
+    free(iov);
+
+    p->s.base = p->pinned;
+    return &p->s;
+}
+
+static char* pread_cluster(Storage* s, int cluster){
+    PreadStorage* p = (PreadStorage*)s;
+    int block = cluster / BLOCK_CLUSTERS;
+    if(block < p->pinned_blocks) return p->pinned + (long)cluster * CLUSTER_SIZE;
+
+    pthread_mutex_lock(&p->cache_lock);
+    CacheBlock* cached = p->blocks[block];
+    if(!cached){
+        // The cache never grows past its limit, whatever the command: the least recently used block makes room.
+        // Whoever still holds a pointer to it is not told, that's why pread is not concurrent
+        cache_trim(p, p->cache_limit - 1);
+        cached = p->free_slots;
+        p->free_slots = cached->next;
+        cached->block = block;
+        cached->dirty = 0;
+        struct iovec iov = { cached->buf, BLOCK_SIZE };
+        transfer(p, 0, block, 1, &iov);
+        p->blocks[block] = cached;
+        p->cached_count++;
+        lru_push(p, cached);
+    }
+    else if(cached != p->lru_head){
+        lru_unlink(p, cached);
+        lru_push(p, cached);
+    }
+    pthread_mutex_unlock(&p->cache_lock);
+
+    return cached->buf + (cluster % BLOCK_CLUSTERS) * CLUSTER_SIZE;
+}
+
+static void pread_dirty(Storage* s, int cluster){
+    PreadStorage* p = (PreadStorage*)s;
+    int block = cluster / BLOCK_CLUSTERS;
+    pthread_mutex_lock(&p->cache_lock);
+    if(block < p->pinned_blocks){
+        if(!p->pinned_dirty[block]){
+            p->pinned_dirty[block] = 1;
+            p->dirty_list[p->dirty_count++] = block;
+        }
+    }
+    else if(!p->blocks[block]){
+        // The change was made through a pointer to this block, if it's gone the change is gone with it.
+        // fs.c asks again for clusters it modifies after touching others, so this is a bug worth reporting, not a crash
+        fprintf(fs_output(), "pread: change to cluster %d lost, its block left the cache before being marked\n", cluster);
+    }
+    else{
+        if(!p->blocks[block]->dirty){
+            p->blocks[block]->dirty = 1;
+            p->dirty_list[p->dirty_count++] = block;
+        }
+    }
+    pthread_mutex_unlock(&p->cache_lock);
+}
+
+static void pread_read(Storage* s, int cluster, char* buf){
+    PreadStorage* p = (PreadStorage*)s;
+    int block = cluster / BLOCK_CLUSTERS;
+    int offset = (cluster % BLOCK_CLUSTERS) * CLUSTER_SIZE;
+    if(block < p->pinned_blocks){
+        memcpy(buf, p->pinned + (long)cluster * CLUSTER_SIZE, CLUSTER_SIZE);
+        return;
+    }
+
+    pthread_mutex_lock(&p->cache_lock);
+    if(p->blocks[block]){
+        memcpy(buf, p->blocks[block]->buf + offset, CLUSTER_SIZE);
+        pthread_mutex_unlock(&p->cache_lock);
+        return;
+    }
+    pthread_mutex_unlock(&p->cache_lock);
+
+    // Not cached: read it on the side so that a full scan doesn't flush the cache
+    static __thread char scratch[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+    struct iovec iov = { scratch, BLOCK_SIZE };
+    transfer(p, 0, block, 1, &iov);
+    memcpy(buf, scratch + offset, CLUSTER_SIZE);
+}
+
+// Every block the command modified goes out now, in one sorted batch: once a command is done its changes are in
+// the file (the page cache at least), just like they are with mmap
+static void pread_release(Storage* s){
+    PreadStorage* p = (PreadStorage*)s;
+    pthread_mutex_lock(&p->cache_lock);
+    write_dirty(p);
+    pthread_mutex_unlock(&p->cache_lock);
+}
+
+static void pread_flush(Storage* s){
+    PreadStorage* p = (PreadStorage*)s;
+    pthread_mutex_lock(&p->cache_lock);
+    write_dirty(p);
+    pthread_mutex_unlock(&p->cache_lock);
+    assert(!fsync(p->io_fd) && "fsync failed");
+}
+
+static void pread_close(Storage* s){
+    PreadStorage* p = (PreadStorage*)s;
+    pthread_mutex_lock(&p->cache_lock);
+    write_dirty(p);
+    pthread_mutex_unlock(&p->cache_lock);
+
+    free(p->blocks);
+    free(p->cache_slots);
+    free(p->cache_pool);
+    free(p->pinned);
+    free(p->pinned_dirty);
+    free(p->dirty_list);
+    if(p->direct_fd != -1) close(p->direct_fd);
+    pthread_mutex_destroy(&p->cache_lock);
+    free(p);
+}
+
+const Backend pread_backend = {
+    "pread", pread_open, pread_cluster, pread_dirty, pread_read, pread_release, pread_flush, NULL, NULL, pread_close, 0
+};
+
+// ---------------------------------------------------------------------------------------------
+// memory backend: the image is loaded once and changes are thrown away on close (benchmarks, replays
+// that must leave the image as it was)
+
+static Storage* memory_open(int fd, long size, const BackendOptions* options){
+    char* base = malloc(size);
+    if(!base) return NULL;
+    for(long done = 0; done < size; ){
+        ssize_t got = pread(fd, base + done, size - done, done);
+        if(got <= 0){
+            free(base);
+            return NULL;
+        }
+        done += got;
+    }
+
+    Storage* s = malloc(sizeof(Storage));
+    assert(s && "malloc failed");
+    s->backend = &memory_backend;
+    s->base = base;
+    return s;
+}
+
+static char* memory_cluster(Storage* s, int cluster){
+    return (char*)s->base + (long)CLUSTER_SIZE * cluster;
+}
+
+static void memory_dirty(Storage* s, int cluster){
+}
+
+static void memory_read(Storage* s, int cluster, char* buf){
+    memcpy(buf, memory_cluster(s, cluster), CLUSTER_SIZE);
+}
+
+static void memory_release(Storage* s){
+}
+
+static void memory_flush(Storage* s){
+}
+
+static void memory_close(Storage* s){
+    free(s->base);
+    free(s);
+}
+
+const Backend memory_backend = {
+    "memory", memory_open, memory_cluster, memory_dirty, memory_read, memory_release, memory_flush, NULL, NULL, memory_close, 1
+};
+
+const Backend* find_backend(const char* name){
+    const Backend* all[] = { &mmap_backend, &pread_backend, &memory_backend };
+    for(int i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++)
+        if(strcmp(all[i]->name, name) == 0) return all[i];
+    return NULL;
+}
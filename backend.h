@@ -0,0 +1,48 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stddef.h>
+
+// Options given to a backend when an image is opened
+typedef struct BackendOptions{
+    int window_mb;      // mmap: keep at most this many MB of data resident (0 = no limit)
+    int cache_mb;       // pread: size of the cluster cache (0 = default)
+    int direct;         // pread: bypass the page cache with O_DIRECT
+} BackendOptions;
+
+typedef struct Backend Backend;
+
+// One image opened through a backend. Each backend keeps the rest of its state right after these fields,
+// so every open image has its own and any number of them can be open at once
+typedef struct Storage{
+    const Backend* backend;
+    void* base;         // boot sector, FAT and checksum table (contiguous and always resident)
+} Storage;
+
+// How fs.c reaches the clusters of an open image.
+// Pointers returned by cluster() are good for a while, not forever: a backend with a bounded footprint drops the
+// clusters asked for least recently (pread once a cache worth of other blocks has been loaded, at least 1 MB,
+// mmap --window faults them back in outside the window). A few clusters touched in between are fine, anything
+// that may go through a whole file or subtree (freeing a chain, recursing, printing) copies what it still needs
+// or asks again for the cluster afterwards, especially before writing to it.
+struct Backend{
+    const char* name;
+    Storage* (*open)(int fd, long size, const BackendOptions* options);     // NULL on failure
+    char* (*cluster)(Storage* s, int cluster);
+    void (*dirty)(Storage* s, int cluster);                  // <cluster> has been modified through its pointer
+    void (*read)(Storage* s, int cluster, char* buf);        // copies <cluster> without keeping it around (for full scans)
+    void (*release)(Storage* s);                             // end of a command: changes still held go out
+    void (*flush)(Storage* s);                               // everything modified so far reaches the file
+    void* (*resize)(Storage* s, long new_size);              // grows the image, returns the new base address (NULL if unsupported)
+    void (*writeback)(Storage* s, int first, int count);     // starts writing clusters to disk without waiting (NULL if the backend schedules its own writes)
+    void (*close)(Storage* s);
+    int concurrent;     // 1 if a thread can keep using a cluster pointer while other threads ask for clusters
+};
+
+extern const Backend mmap_backend;
+extern const Backend pread_backend;
+extern const Backend memory_backend;
+
+const Backend* find_backend(const char* name);
+
+#endif
@@ -0,0 +1,87 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected Castagnoli polynomial
+
+static uint32_t crc_table[256];
+static uint32_t (*impl)(uint32_t, const unsigned char*, size_t) = NULL;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+// Plain table driven version, used when the CPU has no CRC instruction
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len){
+    while(len--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len){
+    uint64_t c = crc;
+    while(len >= 8){
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while(len--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+
+static int hw_available(){
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+// ARMv8 crc32c instructions, 8 bytes per step
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len){
+    while(len >= 8){
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while(len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static int hw_available(){
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+// Pick the implementation once (scrub calls us from several threads at the same time)
+static void crc32c_init(){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+
+#if defined(__x86_64__) || defined(__aarch64__)
+    impl = hw_available() ? crc32c_hw : crc32c_sw;
+#else
+    impl = crc32c_sw;
+#endif
+}
+
+uint32_t crc32c(const void* buf, size_t len){
+    pthread_once(&impl_once, crc32c_init);
+    return ~impl(~0u, (const unsigned char*)buf, len);
+}
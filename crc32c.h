@@ -0,0 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of <len> bytes starting at <buf>
+uint32_t crc32c(const void* buf, size_t len);
@@ -6,26 +6,97 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fs.h"
-
-void *fs_data = NULL; // only used for mmapping, useless later
+#include "crc32c.h"
+
+#define MAX_THREADS 16
+#define MAX_SCRUB_REPORT 32
+#define EXPORT_MAGIC "SHFSEXP1"
+#define WRITEBACK_DEFAULT_MS 100
+#define WRITEBACK_DEFAULT_KB 4096
+#define MAX_MOUNTS 8
+#define COPY_BATCH 256      // clusters cp moves from one image to the other at a time
+#define FAT_PENDING 64      // FAT clusters waiting for their checksum
+
+void *fs_data = NULL;        // boot sector, FAT and checksums as handed out by the backend
+const Backend *backend = NULL;
+Storage *storage = NULL;     // the image as opened by <backend>
 FileSystem *fs = NULL;
 int fs_fd = -1;
 int fs_size = -1;
 int *fat = NULL;             // FAT array
-char *data = NULL;           // data buffer
-FSEntry *current_dir = NULL; // pointer
-int current_cluster;         // index of current cluster
-int current_entry_count;     // number of entries in current directory
+uint32_t *crc = NULL;        // checksum table (one CRC32C per cluster), NULL if disabled
+int fat_pending[FAT_PENDING];    // FAT clusters modified since their checksum was last computed
+int fat_pending_count = 0;
+// Dirty cluster tracking: every change sets a bit, the flusher thread gets the kernel writing
+// a few dirty runs at a time so writeback doesn't pile up and come out in one burst
+uint64_t *dirty_bits = NULL;  // one bit per cluster, NULL if no FS is open
+int dirty_words = 0;
+int writeback_cursor = 0;     // word the next pass starts from, so every run gets its turn
+int writeback_ms = WRITEBACK_DEFAULT_MS;  // 0 = flusher paused
+int writeback_kb = WRITEBACK_DEFAULT_KB;  // most we start writing in one pass
+int writeback_stop = 0;
+int writeback_running = 0;
+pthread_t writeback_thread;
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;  // flusher pass vs bitmap resize, sync and settings
+pthread_cond_t writeback_wake = PTHREAD_COND_INITIALIZER;
+
+static void writeback_start();
+static void writeback_stop_thread();
+static void dirty_resize(int cluster_count);
+static void fat_checksums();
+
+// Several images can be open at once, the globals above and below always describe the active one
+// while the others wait parked in their Mount
+typedef struct Mount{
+    char name[FILENAME_LEN];
+    char image[256];
+    dev_t dev;              // to refuse the same image twice under different names
+    ino_t ino;
+    Storage *storage;
+    void *fs_data;
+    FileSystem *fs;
+    int fs_fd;
+    int fs_size;
+    int *fat;
+    uint32_t *crc;
+    FSEntry *current_dir;
+    int current_cluster;
+    int current_entry_count;
+    uint64_t *dirty_bits;
+    int dirty_words;
+    int writeback_cursor;
+} Mount;
+
+Mount mounts[MAX_MOUNTS];
+int mount_count = 0;
+int active_mount = -1;      // -1 if nothing is mounted (or the image was opened with open_fs directly)
+pthread_t mount_owner;      // thread that mounted, the only one allowed to switch
+
+// Working directory is per thread: in server mode every client has its own
+__thread FSEntry *current_dir = NULL; // pointer
+__thread int current_cluster;         // index of current cluster
+__thread int current_entry_count;     // number of entries in current directory
+__thread FILE *fs_out = NULL;         // where commands print, NULL = stdout
+
+// Address of <cluster>, every cluster access goes through the backend
+static inline char* cluster_at(int cluster){
+    return backend->cluster(storage, cluster);
+}
 
-// Creates file system named <fs_filename> of <size> bytes
-void format(const char *fs_filename, int size){
+// Creates file system named <fs_filename> of <size> bytes, with per-cluster checksums if <checksums> is set
+void format(const char *fs_filename, int size, int checksums){
     // We want to check if <fs_filename> already exists
     int test_fd = open(fs_filename, O_RDONLY);
     if (test_fd != -1) {
         close(test_fd);
-        printf("format: file system '%s' already exists\n", fs_filename);
+        fprintf(fs_output(), "format: file system '%s' already exists\n", fs_filename);
         return;
     }
 
@@ -33,12 +104,14 @@ void format(const char *fs_filename, int size){
     int fat_bytes = cluster_count * sizeof(int);
     int fat_clusters = (fat_bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE; // how many clusters do I need to store all FAT bytes?
     int fat_start = 1;                                                // entry 0 of FAT is usually reserved for Boot Sector
-    int data_start = fat_start + fat_clusters;
+    int crc_clusters = checksums ? fat_clusters : 0;                  // checksum table has one 32 bit entry per cluster, just like the FAT
+    int crc_start = fat_start + fat_clusters;
+    int data_start = crc_start + crc_clusters;
 
-    // We want to make sure there is enough space for Boot Sector cluster, one FAT cluster and at least one data cluster (root) 
-    int min_clusters = fat_start + fat_clusters + 1;      
+    // We want to make sure there is enough space for Boot Sector cluster, FAT (and checksum) clusters and at least one data cluster (root) 
+    int min_clusters = data_start + 1;      
     if (cluster_count < min_clusters) {
-        printf("format: size too small (%d B). Minimum is %d B for this cluster size (%d)\n",
+        fprintf(fs_output(), "format: size too small (%d B). Minimum is %d B for this cluster size (%d)\n",
                size, min_clusters * CLUSTER_SIZE, CLUSTER_SIZE);
         return;
     }
@@ -48,16 +121,19 @@ void format(const char *fs_filename, int size){
 
     assert(!ftruncate(fs_fd, size) && "ftruncate failed");
 
-    fs_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
-    assert(fs_data != MAP_FAILED && "mmap failed");
+    backend = &mmap_backend;
+    storage = backend->open(fs_fd, size, NULL);
+    assert(storage && "mmap failed");
+    fs_data = storage->base;
 
     fs = (FileSystem *)fs_data;
     fs->total_cluster = cluster_count;
     fs->fat_start = fat_start;
     fs->data_start = data_start;
+    fs->crc_start = checksums ? crc_start : 0;
 
     fat = (int *)(fs_data + CLUSTER_SIZE * fat_start); // FAT clusters are stored after Boot Sector cluster
-    data = fs_data + CLUSTER_SIZE * data_start;        // data clusters start after Boot Sector + FAT clusters
+    crc = checksums ? (uint32_t *)(fs_data + CLUSTER_SIZE * crc_start) : NULL; // checksum table sits right after the FAT
 
     // Initialize FAT (0 means free cluster, -1 means EOC)
     for (int i = 0; i < cluster_count; i++)
@@ -67,18 +143,37 @@ void format(const char *fs_filename, int size){
     fat[fs->root_cluster] = FAT_EOC;
 
     // Create . dir in root with entry_count = 1
-    FSEntry* root_entries = (FSEntry*)(data + CLUSTER_SIZE * (fs->root_cluster - fs->data_start) + sizeof(int));
+    FSEntry* root_entries = (FSEntry*)(cluster_at(fs->root_cluster) + sizeof(int));
     strcpy(root_entries[0].name, ".");
     root_entries[0].is_dir = 1;
     root_entries[0].start_cluster = fs->root_cluster;
-    *(int*)(data + CLUSTER_SIZE * (fs->root_cluster - fs->data_start)) = 1;
+    *(int*)(cluster_at(fs->root_cluster)) = 1;
+
+    // Boot sector, FAT and root get their real checksum. Every other data cluster is still all zeroes and shares the
+    // same one, no need to touch them (nor the pages behind them). The table itself is not covered
+    if(crc){
+        for(int i = 0; i < crc_start; i++)
+            cluster_changed(i);
+        char zero[CLUSTER_SIZE] = {0};
+        uint32_t zero_crc = crc32c(zero, CLUSTER_SIZE);
+        for(int i = data_start; i < cluster_count; i++)
+            crc[i] = zero_crc;
+        cluster_changed(fs->root_cluster);
+    }
 
-    assert(!munmap(fs_data, size) && "munmap failed");
+    backend->close(storage);
     assert(!close(fs_fd) && "file close failed");
+    backend = NULL;
+    storage = NULL;
+    fs = NULL;
+    fs_data = NULL;
+    fat = NULL;
+    crc = NULL;
 }
 
-// Opens <fs_filename>
-int open_fs(const char *fs_filename){
+// Opens <fs_filename> through backend <with> (mmap if NULL). Returns -1 if the file doesn't exist,
+// -2 if the backend couldn't load it
+int open_fs(const char *fs_filename, const Backend *with, const BackendOptions *options){
     fs_fd = open(fs_filename, O_RDWR, 0600);
     if(fs_fd < 0)
         return -1;
@@ -87,34 +182,86 @@ int open_fs(const char *fs_filename){
     assert(fstat(fs_fd, &st) == 0 && "fstat failed");
     fs_size = st.st_size;
 
-    fs_data = mmap(NULL, fs_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
-    assert(fs_data != MAP_FAILED && "mmap failed");
+    backend = with ? with : &mmap_backend;
+    storage = backend->open(fs_fd, fs_size, options);
+    if(!storage){
+        close(fs_fd);
+        fs_fd = -1;
+        backend = NULL;
+        return -2;
+    }
+    fs_data = storage->base;
 
     // Retrieves all FS parameters
     fs = (FileSystem *)fs_data;
     assert(fs != NULL && "FS address error");
 
     fat = (int *)(fs_data + CLUSTER_SIZE * fs->fat_start);
-    data = (char *)(fs_data + CLUSTER_SIZE * fs->data_start);
+    crc = fs->crc_start ? (uint32_t *)(fs_data + CLUSTER_SIZE * fs->crc_start) : NULL;
+
+    // A broken FAT would send us around the image following garbage, so we check it once here
+    for (int i = 0; i < fs->crc_start; i++){
+        if (verify_cluster(i) == -1)
+            fprintf(fs_output(), "open: checksum mismatch on %s cluster %d, run 'scrub'\n", i ? "FAT" : "boot", i);
+    }
+
+    // Backends scheduling their own writes don't need the flusher (nor the bitmap)
+    if(backend->writeback){
+        dirty_resize(fs->total_cluster);
+        writeback_start();
+    }
 
     // We start from root
+    reset_current_dir();
+    return 0;
+}
+
+// Moves the working directory of the calling thread back to root
+void reset_current_dir(){
     current_cluster = fs->root_cluster;
     assert(current_cluster >= fs->data_start && current_cluster < fs->total_cluster && "current cluster out of bounds");
-    current_dir = (FSEntry *)(data + CLUSTER_SIZE * (current_cluster - fs->data_start) + sizeof(int));
-    current_entry_count = *(int*)(data + CLUSTER_SIZE * (current_cluster - fs->data_start));
+    current_dir = (FSEntry *)(cluster_at(current_cluster) + sizeof(int));
+    current_entry_count = *(int*)(cluster_at(current_cluster));
+}
 
-    return 0;
+// Returns 1 if <cluster> still holds a directory, in server mode another client may have removed the one it was in
+int directory_exists(int cluster){
+    if (cluster == fs->root_cluster) return 1;
+    if (cluster < fs->data_start || cluster >= fs->total_cluster || fat[cluster] == 0) return 0;
+
+    // Freed clusters are zeroed, a directory always starts with "." pointing to itself
+    char *cluster_ptr = cluster_at(cluster);
+    FSEntry *entries = (FSEntry *)(cluster_ptr + sizeof(int));
+    return *(int *)cluster_ptr > 0 && entries[0].is_dir && strcmp(entries[0].name, ".") == 0 &&
+           entries[0].start_cluster == cluster;
+}
+
+// Output stream of the calling thread
+FILE *fs_output(){
+    return fs_out ? fs_out : stdout;
+}
+
+// Lets go of an image whatever mount it is in, the backend writes back what it still holds
+static void close_storage(Storage *s, int fd, uint64_t *bits){
+    free(bits);
+    s->backend->close(s);
+    assert(!close(fd) && "file close failed");
 }
 
 // Closes currently open FS
 void close_fs(){
-    assert(!munmap(fs_data, fs_size) && "munmap failed");
-    assert(!close(fs_fd) && "file close failed");
+    fat_checksums();
+    writeback_stop_thread();
+    close_storage(storage, fs_fd, dirty_bits);
+    dirty_bits = NULL;
+    dirty_words = 0;
+    backend = NULL;
+    storage = NULL;
     fs = NULL;
     fs_fd = -1;
     fs_data = NULL;
     fat = NULL;
-    data = NULL;
+    crc = NULL;
     current_dir = NULL;
 }
 
@@ -122,25 +269,26 @@ void close_fs(){
 void _mkdir(const char *name){
     // Check that dir name isn't longer than FILENAME_LEN bytes
     if (strlen(name) >= FILENAME_LEN){
-        printf("mkdir: name too long\n");
+        fprintf(fs_output(), "mkdir: name too long\n");
         return;
     }
 
     // Can't create dir with no name or .(current), ..(parent) name, I'll cry
     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        printf("mkdir: invalid directory name\n");
+        fprintf(fs_output(), "mkdir: invalid directory name\n");
         return;
     }
 
     // Check if name has already been used
     int temp_cluster = current_cluster;
     while (temp_cluster != FAT_EOC){
-        void *cluster_data = data + CLUSTER_SIZE * (temp_cluster - fs->data_start);
+        if (check_cluster(temp_cluster, "mkdir") == -1) return;
+        void *cluster_data = cluster_at(temp_cluster);
         FSEntry *entries = (FSEntry *)(cluster_data + sizeof(int));
         int cluster_entry_count = *(int *)(cluster_data);
         for (int i = 0; i < cluster_entry_count; i++){
             if (strcmp(entries[i].name, name) == 0){
-                printf("mkdir: directory '%s' is already existing\n", name);
+                fprintf(fs_output(), "mkdir: directory '%s' is already existing\n", name);
                 return;
             }
         }
@@ -150,7 +298,7 @@ void _mkdir(const char *name){
     // Find a free cluster on FAT
     int new_cluster = allocate_new_cluster(-1);
     if (new_cluster == -1){
-        printf("mkdir: no empty space\n");
+        fprintf(fs_output(), "mkdir: no empty space\n");
         return;
     }
 
@@ -163,13 +311,13 @@ void _mkdir(const char *name){
     entry.size = 0;
 
     if (insert_entry_in_directory(entry) == -1){
-        printf("mkdir: not enough space to insert entry\n");
+        fprintf(fs_output(), "mkdir: not enough space to insert entry\n");
         return;
     }
 
     // Initialize new cluster entry count to 2
-    FSEntry *new_dir_entries = (FSEntry *)(data + CLUSTER_SIZE * (new_cluster - fs->data_start) + sizeof(int));
-    *(int *)(data + CLUSTER_SIZE * (new_cluster - fs->data_start)) = 2;
+    FSEntry *new_dir_entries = (FSEntry *)(cluster_at(new_cluster) + sizeof(int));
+    *(int *)(cluster_at(new_cluster)) = 2;
 
     // To make cd command code easier I want to map self and parent dir in the new dir entries array
     strcpy(new_dir_entries[0].name, ".");
@@ -179,20 +327,21 @@ void _mkdir(const char *name){
     strcpy(new_dir_entries[1].name, "..");
     new_dir_entries[1].is_dir = 1;
     new_dir_entries[1].start_cluster = current_cluster;  
+    cluster_changed(new_cluster);
 }
 
 void _cd(const char *name){
     // Check that dir name isn't longer than FILENAME_LEN bytes
     if (strlen(name) >= FILENAME_LEN){
-        printf("cd: name too long\n");
+        fprintf(fs_output(), "cd: name too long\n");
         return;
     }
 
     // I have to consider the possibility that user may want to go back to root directory
     if (strcmp(name, "/") == 0){
         current_cluster = fs->root_cluster;
-        current_dir = (FSEntry *)(data + CLUSTER_SIZE * (current_cluster - fs->data_start) + sizeof(int));
-        current_entry_count = *(int *)(data + CLUSTER_SIZE * (current_cluster - fs->data_start));
+        current_dir = (FSEntry *)(cluster_at(current_cluster) + sizeof(int));
+        current_entry_count = *(int *)(cluster_at(current_cluster));
         return;
     }
 
@@ -202,7 +351,8 @@ void _cd(const char *name){
         // Don't you dare moving
     }
     else if (strcmp(name, "..") == 0){
-        void *cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if (check_cluster(cluster, "cd") == -1) return;
+        void *cluster_ptr = cluster_at(cluster);
         FSEntry *entries = (FSEntry *)(cluster_ptr + sizeof(int));
         int entry_count = *(int *)cluster_ptr;
 
@@ -217,7 +367,7 @@ void _cd(const char *name){
         }
 
         if (!found){
-            printf("cd: no parent directory\n");
+            fprintf(fs_output(), "cd: no parent directory\n");
             return;
         }
     }
@@ -227,13 +377,14 @@ void _cd(const char *name){
 
         // Scan through all dir clusters until I find the subdir I'm looking for
         while (temp_cluster != FAT_EOC){
-            void *cluster_ptr = data + CLUSTER_SIZE * (temp_cluster - fs->data_start);
+            if (check_cluster(temp_cluster, "cd") == -1) return;
+            void *cluster_ptr = cluster_at(temp_cluster);
             int entry_count = *(int*)cluster_ptr;
             FSEntry *entries = (FSEntry*)(cluster_ptr + sizeof(int));
 
             for (int i = 0; i < entry_count; i++){
                 if(strcmp(entries[i].name, name) == 0 && !entries[i].is_dir){
-                    printf("cd: '%s' not a directory\n", name);
+                    fprintf(fs_output(), "cd: '%s' not a directory\n", name);
                     return;
                 }
                 else if(strcmp(entries[i].name, name) == 0 && entries[i].is_dir){
@@ -248,27 +399,27 @@ void _cd(const char *name){
         }
 
         if (!found){
-            printf("cd: directory '%s' not found\n", name);
+            fprintf(fs_output(), "cd: directory '%s' not found\n", name);
             return;
         }
     }
 
     // Update cluster information
     current_cluster = cluster;
-    current_dir = (FSEntry *)(data + CLUSTER_SIZE * (cluster - fs->data_start) + sizeof(int));
-    current_entry_count = *(int *)(data + CLUSTER_SIZE * (cluster - fs->data_start));
+    current_dir = (FSEntry *)(cluster_at(cluster) + sizeof(int));
+    current_entry_count = *(int *)(cluster_at(cluster));
 }
 
 void _rm(const char* name){
     // Check that dir name isn't longer than FILENAME_LEN bytes
     if (strlen(name) >= FILENAME_LEN){
-        printf("rm: name too long\n");
+        fprintf(fs_output(), "rm: name too long\n");
         return;
     }
 
     // Can't remove current or parent dir, I'll cry
     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        printf("rm: invalid directory name\n");
+        fprintf(fs_output(), "rm: invalid directory name\n");
         return;
     }
 
@@ -276,7 +427,8 @@ void _rm(const char* name){
     int cluster = current_cluster;
 
     while(!found && cluster != FAT_EOC){
-        void* cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if(check_cluster(cluster, "rm") == -1) return;
+        void* cluster_ptr = cluster_at(cluster);
         FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
         int entry_count = *(int*)cluster_ptr;
 
@@ -287,19 +439,22 @@ void _rm(const char* name){
                 // If the entry is a directory and it's not empty we can't remove it (same as we can't create directories recursively)
                 if(entries[i].is_dir){
                     int dir_cluster = entries[i].start_cluster;
-                    int dir_entry_count = *(int*)(data + CLUSTER_SIZE * (dir_cluster - fs->data_start));
+                    if(check_cluster(dir_cluster, "rm") == -1) return;
+                    int dir_entry_count = *(int*)(cluster_at(dir_cluster));
 
                     // There are other entries apart from . and ..
                     if(dir_entry_count > 2){
-                        printf("rm: directory not empty\n");
+                        fprintf(fs_output(), "rm: directory not empty\n");
                         return;
                     }
                 }
 
-                free_cluster_chain(entries[i].start_cluster);
+                // Freeing a big file goes through all of its clusters, the directory cluster may not be around afterwards
+                FSEntry removed = entries[i];
+                free_cluster_chain(removed.start_cluster);
 
-                if(remove_entry_from_directory(entries[i].name) == -1)
-                    printf("rm: error removing entry\n");
+                if(remove_entry_from_directory(removed.name) == -1)
+                    fprintf(fs_output(), "rm: error removing entry\n");
 
                 return;
             }
@@ -308,7 +463,7 @@ void _rm(const char* name){
     }
 
     if(!found){
-        printf("rm: '%s' not found\n", name);
+        fprintf(fs_output(), "rm: '%s' not found\n", name);
         return;
     }
 }
@@ -316,7 +471,7 @@ void _rm(const char* name){
 void _ls(const char* name){
     // Check that dir name isn't longer than FILENAME_LEN bytes
     if (strlen(name) >= FILENAME_LEN){
-        printf("ls: name too long\n");
+        fprintf(fs_output(), "ls: name too long\n");
         return;
     }
 
@@ -325,7 +480,8 @@ void _ls(const char* name){
 
     // We go through all the clusters of the current directory until we find the one we're looking for
     while(cluster != FAT_EOC && !found){
-        void* cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if(check_cluster(cluster, "ls") == -1) return;
+        void* cluster_ptr = cluster_at(cluster);
         FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
         int entry_count = *(int*)cluster_ptr;
         
@@ -335,21 +491,23 @@ void _ls(const char* name){
                 if(entries[i].is_dir){
                     int dir_cluster = entries[i].start_cluster;
                     while(dir_cluster != FAT_EOC){
-                        void* dir_cluster_ptr = data + CLUSTER_SIZE * (dir_cluster - fs->data_start);
+                        if(check_cluster(dir_cluster, "ls") == -1) return;
+                        void* dir_cluster_ptr = cluster_at(dir_cluster);
                         FSEntry* dir_entries = (FSEntry*)(dir_cluster_ptr + sizeof(int));
                         int dir_entry_count = *(int*)dir_cluster_ptr;
 
                         for(int j = 0; j < dir_entry_count; j++){
-                            printf("%s", dir_entries[j].name);
-                            if(j != dir_entry_count - 1) printf(" | ");
+                            fprintf(fs_output(), "%s", dir_entries[j].name);
+                            if(j != dir_entry_count - 1) fprintf(fs_output(), " | ");
                         }
-                        if(fat[dir_cluster] != FAT_EOC) printf(" | ");
-                        else printf("\n");
+                        if(fat[dir_cluster] != FAT_EOC) fprintf(fs_output(), " | ");
+                        else fprintf(fs_output(), "\n");
                         dir_cluster = fat[dir_cluster];
                     }
+                    break;      // a long listing may have pushed <entries> out of the backend cache
                 }
                 else{
-                    printf("ls: '%s' not a directory\n", name);
+                    fprintf(fs_output(), "ls: '%s' not a directory\n", name);
                     return;
                 }
             }
@@ -358,7 +516,7 @@ void _ls(const char* name){
     }
 
     if(!found){
-        printf("ls: '%s' not found\n", name);
+        fprintf(fs_output(), "ls: '%s' not found\n", name);
         return;
     }
 }
@@ -366,25 +524,26 @@ void _ls(const char* name){
 void _touch(const char* name){
     // We want the filename to stay within FILENAME_LEN bytes
     if(strlen(name) >= FILENAME_LEN){
-        printf("touch: name is too long\n");
+        fprintf(fs_output(), "touch: name is too long\n");
         return;
     }
 
     // Can't create file with no name or .(current), ..(parent) name, I'll cry
     if (strlen(name) == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        printf("touch: invalid file name\n");
+        fprintf(fs_output(), "touch: invalid file name\n");
         return;
     }
 
     // Check if name has already been used in current directory
     int temp_cluster = current_cluster;
     while(temp_cluster != FAT_EOC){
-        void* cluster_data = data + CLUSTER_SIZE * (temp_cluster - fs->data_start);
+        if(check_cluster(temp_cluster, "touch") == -1) return;
+        void* cluster_data = cluster_at(temp_cluster);
         int entry_count = *(int*)cluster_data;
         FSEntry* entries = (FSEntry*)(cluster_data + sizeof(int));
         for(int i = 0; i < entry_count; i++){
             if(strcmp(entries[i].name, name) == 0){
-                printf("touch: file '%s' is already existing\n", name);
+                fprintf(fs_output(), "touch: file '%s' is already existing\n", name);
                 return;
             }
         }
@@ -394,7 +553,7 @@ void _touch(const char* name){
     // Find a free cluster on FAT
     int new_cluster = allocate_new_cluster(-1);
     if(new_cluster == -1){
-        printf("touch: no empty space\n");
+        fprintf(fs_output(), "touch: no empty space\n");
         return;
     }
 
@@ -407,7 +566,7 @@ void _touch(const char* name){
     entry.start_cluster = new_cluster;
 
     if(insert_entry_in_directory(entry) == -1){
-        printf("touch: not enough space to insert entry\n");
+        fprintf(fs_output(), "touch: not enough space to insert entry\n");
         return;
     }
 }
@@ -415,21 +574,22 @@ void _touch(const char* name){
 void _cat(const char* name){
     // We want the filename to stay within FILENAME_LEN bytes
     if(strlen(name) >= FILENAME_LEN){
-        printf("cat: name is too long\n");
+        fprintf(fs_output(), "cat: name is too long\n");
         return;
     }
 
     int cluster = current_cluster;
 
     while(cluster != FAT_EOC){
-        void* cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if(check_cluster(cluster, "cat") == -1) return;
+        void* cluster_ptr = cluster_at(cluster);
         FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
         int entry_count = *(int*)cluster_ptr;
 
         for(int i = 0; i < entry_count; i++){
             if(strcmp(entries[i].name, name) == 0){
-                if(entries[i].is_dir) printf("cat: '%s' is a directory\n", name);
-                else if(!entries[i].size) printf("cat: empty file\n");
+                if(entries[i].is_dir) fprintf(fs_output(), "cat: '%s' is a directory\n", name);
+                else if(!entries[i].size) fprintf(fs_output(), "cat: empty file\n");
                 else read_file(entries[i].start_cluster, entries[i].size);
                 return;
             }
@@ -437,13 +597,13 @@ void _cat(const char* name){
         cluster = fat[cluster];
     }
 
-    printf("cat: '%s' not found\n", name);
+    fprintf(fs_output(), "cat: '%s' not found\n", name);
 }
 
 void _append(const char* name, const char* text){
      // We want the filename to stay within FILENAME_LEN bytes
     if(strlen(name) >= FILENAME_LEN){
-        printf("append: name is too long\n");
+        fprintf(fs_output(), "append: name is too long\n");
         return;
     }
 
@@ -451,7 +611,7 @@ void _append(const char* name, const char* text){
     char text_copy[CLUSTER_SIZE];
 
     if (strlen(text) + 2 > CLUSTER_SIZE) {          // +1 per '\n', +1 per '\0'
-        printf("append: text is too long\n");
+        fprintf(fs_output(), "append: text is too long\n");
         return;
     }
 
@@ -461,7 +621,8 @@ void _append(const char* name, const char* text){
 
     int cluster = current_cluster;
     while(cluster != FAT_EOC){
-        void* cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if(check_cluster(cluster, "append") == -1) return;
+        void* cluster_ptr = cluster_at(cluster);
         FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
         int entry_count = *(int*)cluster_ptr;
 
@@ -469,24 +630,27 @@ void _append(const char* name, const char* text){
             if(strcmp(entries[i].name, name) == 0){
                 if(!entries[i].is_dir){
                     write_file(entries[i].start_cluster, entries[i].size, text_copy);
+                    entries = (FSEntry*)(cluster_at(cluster) + sizeof(int));     // asked again after touching other clusters
                     entries[i].size += strlen(text_copy);
+                    cluster_changed(cluster);
                 }
-                else printf("append: '%s' is a directory\n", name);
+                else fprintf(fs_output(), "append: '%s' is a directory\n", name);
                 return;
             }
         }
         cluster = fat[cluster];
     }
-    printf("append: '%s' not found\n", name);
+    fprintf(fs_output(), "append: '%s' not found\n", name);
 }
 
 // Starting from a certain cluster, allocate a new one and mark it as FAT_EOC
 int allocate_new_cluster(int last_cluster){
     for (int i = fs->data_start; i < fs->total_cluster; i++){
         if (fat[i] == 0){
-            fat[i] = FAT_EOC;
-            memset(data + CLUSTER_SIZE * (i - fs->data_start), 0, CLUSTER_SIZE);
-            if(last_cluster >= 0) fat[last_cluster] = i;
+            set_fat(i, FAT_EOC);
+            memset(cluster_at(i), 0, CLUSTER_SIZE);
+            cluster_changed(i);
+            if(last_cluster >= 0) set_fat(last_cluster, i);
             return i;
         }
     }
@@ -497,8 +661,9 @@ int allocate_new_cluster(int last_cluster){
 void free_cluster_chain(int cluster){
     while(cluster != FAT_EOC){
         int next = fat[cluster];
-        fat[cluster] = 0;
-        memset(data + CLUSTER_SIZE * (cluster - fs->data_start), 0, CLUSTER_SIZE);
+        set_fat(cluster, 0);
+        memset(cluster_at(cluster), 0, CLUSTER_SIZE);
+        cluster_changed(cluster);
         cluster = next;
     }
 }
@@ -507,7 +672,9 @@ int insert_entry_in_directory(FSEntry entry){
     int cluster = current_cluster;
 
     while (1){
-        void *cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if (check_cluster(cluster, "insert") == -1)
+            return -1;
+        void *cluster_ptr = cluster_at(cluster);
         int *entry_count_ptr = (int*)cluster_ptr;
         FSEntry *entries = (FSEntry*)(cluster_ptr + sizeof(int));
 
@@ -515,6 +682,7 @@ int insert_entry_in_directory(FSEntry entry){
         if (*entry_count_ptr < MAX_ENTRIES){
             entries[*entry_count_ptr] = entry;
             (*entry_count_ptr)++;
+            cluster_changed(cluster);
             return 0;
         }
 
@@ -536,7 +704,9 @@ int remove_entry_from_directory(const char* name){
     int cluster = current_cluster;
 
     while(1){
-        void* cluster_ptr = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        if(check_cluster(cluster, "remove") == -1)
+            return -1;
+        void* cluster_ptr = cluster_at(cluster);
         FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
         int* entry_count_ptr = (int*)cluster_ptr;
 
@@ -547,6 +717,7 @@ int remove_entry_from_directory(const char* name){
                     entries[j] = entries[j+1];
                 (*entry_count_ptr)--;
                 memset(&entries[*entry_count_ptr], 0, sizeof(FSEntry));
+                cluster_changed(cluster);
                 return 0;
             }
         }
@@ -559,31 +730,40 @@ int remove_entry_from_directory(const char* name){
 void read_file(int start_cluster, int size){
     // Check that cluster is within data bound
     if(start_cluster < fs->data_start || start_cluster >=fs->total_cluster){
-        printf("cat: invalid cluster\n");
+        fprintf(fs_output(), "cat: invalid cluster\n");
         return;
     }
 
+    // The whole chain is checked first, a corrupted file must not be half printed before we complain
     int cluster = start_cluster;
     int remaining = size;
+    while(cluster != FAT_EOC && remaining > 0){
+        if(check_cluster(cluster, "cat") == -1) return;
+        remaining -= remaining < CLUSTER_SIZE ? remaining : CLUSTER_SIZE;
+        cluster = fat[cluster];
+    }
+
+    cluster = start_cluster;
+    remaining = size;
 
     // For each cluster, read its content and jump onto the next
     while(cluster != FAT_EOC && remaining > 0){
-        char* payload = data + CLUSTER_SIZE * (cluster - fs->data_start);
+        char* payload = cluster_at(cluster);
         int chunk = remaining < CLUSTER_SIZE ? remaining : CLUSTER_SIZE;
 
-        fwrite(payload, 1, chunk, stdout);
+        fwrite(payload, 1, chunk, fs_output());
         remaining -= chunk;
         cluster = fat[cluster];
     }
 
-    if(remaining == 0) printf("\n");
-    else printf("cat: couldn't read entire file\n");
+    if(remaining == 0) fprintf(fs_output(), "\n");
+    else fprintf(fs_output(), "cat: couldn't read entire file\n");
 }
 
 void write_file(int start_cluster, int size, const char* text){
     // Check that cluster is within data bound
     if(start_cluster < fs->data_start || start_cluster >=fs->total_cluster){
-        printf("append: invalid cluster\n");
+        fprintf(fs_output(), "append: invalid cluster\n");
         return;
     }
 
@@ -595,13 +775,17 @@ void write_file(int start_cluster, int size, const char* text){
     int offset = size % CLUSTER_SIZE;
     int remaining = strlen(text) + 1;   // Includes '\0'
 
+    // Writing over a corrupted cluster would give it a brand new (valid) checksum, better stop here
+    if(check_cluster(cluster, "append") == -1) return;
+
     while(remaining > 0){
         // We want to see if we can copy all the remaining text or just enough to fill a cluster
         int space_available = CLUSTER_SIZE - offset;
-        char* dest_ptr = (char*)(data + CLUSTER_SIZE * (cluster - fs->data_start) + offset);
+        char* dest_ptr = (char*)(cluster_at(cluster) + offset);
         int chunk = remaining >= space_available ? space_available : remaining;
 
         memcpy(dest_ptr, text, chunk);
+        cluster_changed(cluster);
         remaining -= chunk;
         text += chunk;
         offset = 0;
@@ -610,7 +794,7 @@ void write_file(int start_cluster, int size, const char* text){
         if(remaining > 0){
             int new_cluster = allocate_new_cluster(cluster);
             if (new_cluster == -1){
-                printf("append: no more space available, text partially appended\n");
+                fprintf(fs_output(), "append: no more space available, text partially appended\n");
                 return;
             }
             cluster = new_cluster;
@@ -621,7 +805,7 @@ void write_file(int start_cluster, int size, const char* text){
 void print_path(){
     // If I'm in root, print root!
     if (current_cluster == fs->root_cluster) {
-        printf("~$ ");
+        fprintf(fs_output(), "~$ ");
         return;
     }
 
@@ -640,7 +824,8 @@ void print_path(){
 
         // I start from the current cluster and check if it has a parent directory
         while(current != FAT_EOC && !found){
-            void* cluster_ptr = data + CLUSTER_SIZE * (current - fs->data_start);
+            if(check_cluster(current, "error") == -1) return;
+            void* cluster_ptr = cluster_at(current);
             FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
             int entry_count = *(int*)cluster_ptr;
 
@@ -655,7 +840,7 @@ void print_path(){
         }
 
         if(parent_cluster == -1){
-            printf("error: parent directory not found\n");
+            fprintf(fs_output(), "error: parent directory not found\n");
             return;
         }
 
@@ -664,7 +849,8 @@ void print_path(){
 
         // I extract the name of the current directory from the entries array of its parent
         while(current != FAT_EOC && !found){
-            void* parent_ptr = data + CLUSTER_SIZE * (current - fs->data_start);
+            if(check_cluster(current, "error") == -1) return;
+            void* parent_ptr = cluster_at(current);
             FSEntry* parent_entries = (FSEntry*)(parent_ptr + sizeof(int));
             int parent_entry_count = *(int*)parent_ptr;
 
@@ -680,7 +866,7 @@ void print_path(){
         }
 
         if(!found){
-            printf("error: directory name not found in parent\n");
+            fprintf(fs_output(), "error: directory name not found in parent\n");
             return;
         }
 
@@ -688,10 +874,1786 @@ void print_path(){
     }
 
     // We print the path (after the filename, see shell behaviour)
-    printf("~/");
+    fprintf(fs_output(), "~/");
     for (int i = path_size - 1; i >= 0; i--) {
-        printf("%s", path[i]);
-        if (i > 0) printf("/");
+        fprintf(fs_output(), "%s", path[i]);
+        if (i > 0) fprintf(fs_output(), "/");
+    }
+    fprintf(fs_output(), "$ ");
+}
+
+// Brings the checksums of the FAT clusters modified so far up to date. Must run before anything reads the
+// checksum table of those clusters, fs_release() does it at the end of every command
+static void fat_checksums(){
+    for(int i = 0; i < fat_pending_count; i++)
+        cluster_changed(fat_pending[i]);
+    fat_pending_count = 0;
+}
+
+// FAT cluster <fat_cluster> has been modified. Its checksum is only worked out by fat_checksums(), so that a command
+// updating many entries of the same FAT cluster checksums it once rather than once per entry
+static void fat_changed(int fat_cluster){
+    if(!crc){
+        cluster_changed(fat_cluster);
+        return;
+    }
+    for(int i = 0; i < fat_pending_count; i++)
+        if(fat_pending[i] == fat_cluster) return;
+    if(fat_pending_count == FAT_PENDING) fat_checksums();
+    fat_pending[fat_pending_count++] = fat_cluster;
+}
+
+// Every FAT update goes through here so that the FAT cluster holding the entry gets a valid checksum again
+void set_fat(int cluster, int value){
+    fat[cluster] = value;
+    fat_changed(fs->fat_start + cluster * sizeof(int) / CLUSTER_SIZE);
+}
+
+// Tells the backend and the flusher that <cluster> has to reach the disk
+static void mark_dirty(int cluster){
+    backend->dirty(storage, cluster);
+    if(dirty_bits)
+        __atomic_fetch_or(&dirty_bits[cluster / 64], 1ULL << (cluster % 64), __ATOMIC_RELAXED);
+}
+
+// Must be called after the content of <cluster> has been modified
+void cluster_changed(int cluster){
+    mark_dirty(cluster);
+    if(!crc) return;
+    crc[cluster] = crc32c(cluster_at(cluster), CLUSTER_SIZE);
+    // the checksum table lives in the image too, the backend must write it back
+    mark_dirty(fs->crc_start + cluster * sizeof(uint32_t) / CLUSTER_SIZE);
+}
+
+// Returns -1 if <cluster> doesn't match its checksum, 0 otherwise (or if checksums are disabled)
+int verify_cluster(int cluster){
+    if(!crc) return 0;
+    return crc32c(cluster_at(cluster), CLUSTER_SIZE) == crc[cluster] ? 0 : -1;
+}
+
+// Same as verify_cluster, but complains on behalf of <cmd>
+int check_cluster(int cluster, const char* cmd){
+    if(cluster < 0 || cluster >= fs->total_cluster){
+        fprintf(fs_output(), "%s: cluster %d out of bounds\n", cmd, cluster);
+        return -1;
+    }
+    if(verify_cluster(cluster) == -1){
+        fprintf(fs_output(), "%s: checksum mismatch on cluster %d\n", cmd, cluster);
+        return -1;
+    }
+    return 0;
+}
+
+// How many threads are worth starting for <jobs> independent pieces of work
+static int worker_count(int jobs){
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count > MAX_THREADS) count = MAX_THREADS;
+    if(count > jobs) count = jobs;
+    return count < 1 ? 1 : count;
+}
+
+typedef struct ScrubTask{
+    int first;      // first cluster to check
+    int last;       // one past the last cluster to check
+    int bad_count;
+    int bad[MAX_SCRUB_REPORT];
+} ScrubTask;
+
+static void* scrub_worker(void* arg){
+    ScrubTask* task = (ScrubTask*)arg;
+    char buf[CLUSTER_SIZE];
+    for(int i = task->first; i < task->last; i++){
+        // The checksum table can't vouch for itself
+        if(i >= fs->crc_start && i < fs->data_start) continue;
+
+        // We read a copy, a full scan must not push everything else out of the backend cache
+        backend->read(storage, i, buf);
+        if(crc32c(buf, CLUSTER_SIZE) != crc[i]){
+            if(task->bad_count < MAX_SCRUB_REPORT) task->bad[task->bad_count] = i;
+            task->bad_count++;
+        }
+    }
+    return NULL;
+}
+
+// Verifies every cluster of the image, splitting the work among one thread per CPU
+void scrub(){
+    if(!crc){
+        fprintf(fs_output(), "scrub: checksums are not enabled on this file system\n");
+        return;
+    }
+
+    int thread_count = worker_count(fs->total_cluster);
+    pthread_t threads[MAX_THREADS];
+    ScrubTask tasks[MAX_THREADS];
+    int per_thread = (fs->total_cluster + thread_count - 1) / thread_count;
+
+    for(int t = 0; t < thread_count; t++){
+        tasks[t].first = t * per_thread;
+        tasks[t].last = (t + 1) * per_thread < fs->total_cluster ? (t + 1) * per_thread : fs->total_cluster;
+        tasks[t].bad_count = 0;
+        assert(!pthread_create(&threads[t], NULL, scrub_worker, &tasks[t]) && "pthread_create failed");
+    }
+
+    int bad_total = 0;
+    for(int t = 0; t < thread_count; t++){
+        assert(!pthread_join(threads[t], NULL) && "pthread_join failed");
+        int shown = tasks[t].bad_count < MAX_SCRUB_REPORT ? tasks[t].bad_count : MAX_SCRUB_REPORT;
+        for(int i = 0; i < shown; i++)
+            fprintf(fs_output(), "scrub: checksum mismatch on cluster %d\n", tasks[t].bad[i]);
+        bad_total += tasks[t].bad_count;
+    }
+
+    fprintf(fs_output(), "scrub: %d clusters checked, %d corrupted\n", fs->total_cluster - (fs->data_start - fs->crc_start), bad_total);
+}
+
+typedef struct GrepJob{
+    char* path;         // printed in front of every match
+    int start_cluster;
+    int size;
+    char* out;          // matches found by the worker, printed once everyone is done
+    size_t out_len;
+} GrepJob;
+
+typedef struct GrepSearch{
+    const char* pattern;
+    int pattern_len;
+    GrepJob* jobs;
+    int job_count;
+    int next_job;       // shared among workers, taken with an atomic add
+} GrepSearch;
+
+// Offset of the first match of <pat> fully contained in p[0 .. n + plen - 1), -1 if there's none.
+// We compare first and last byte of the pattern 16 positions at a time and memcmp only the survivors
+static int scan_cluster(const char* p, int n, const char* pat, int plen){
+    int i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(pat[0]);
+    __m128i last = _mm_set1_epi8(pat[plen - 1]);
+    for(; i + 16 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + plen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while(mask){
+            int bit = __builtin_ctz(mask);
+            if(plen < 3 || memcmp(p + i + bit + 1, pat + 1, plen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i < n; i++){
+        if(p[i] == pat[0] && memcmp(p + i, pat, plen) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Address of byte <pos> of the file, good up to the end of its cluster. The cluster is asked to the backend every
+// time, so that a windowed image only keeps resident the part of the file being looked at
+static char* chain_at(int* chain, long pos){
+    return cluster_at(chain[pos / CLUSTER_SIZE]) + pos % CLUSTER_SIZE;
+}
+
+// Does <pat> start at byte <pos> of the file? The match may span any number of clusters
+static int chain_match(int* chain, long pos, const char* pat, int plen){
+    while(plen > 0){
+        int n = CLUSTER_SIZE - pos % CLUSTER_SIZE < plen ? CLUSTER_SIZE - pos % CLUSTER_SIZE : plen;
+        if(memcmp(chain_at(chain, pos), pat, n) != 0) return 0;
+        pos += n;
+        pat += n;
+        plen -= n;
+    }
+    return 1;
+}
+
+// Position of the first <c> in file bytes [from, to), -1 if there's none
+static long chain_find(int* chain, long from, long to, char c){
+    while(from < to){
+        long cluster_end = (from / CLUSTER_SIZE + 1) * CLUSTER_SIZE;
+        long end = cluster_end < to ? cluster_end : to;
+        char* p = chain_at(chain, from);
+        char* hit = memchr(p, c, end - from);
+        if(hit) return from + (hit - p);
+        from = end;
+    }
+    return -1;
+}
+
+// Prints one match as <path>:<line>:<text>, writing the line straight out of the clusters
+static void grep_report(FILE* out, const char* path, int line, int* chain, long from, long to){
+    fprintf(out, "%s:%d:", path, line);
+    while(from < to){
+        long cluster_end = (from / CLUSTER_SIZE + 1) * CLUSTER_SIZE;
+        long end = cluster_end < to ? cluster_end : to;
+        fwrite(chain_at(chain, from), 1, end - from, out);
+        from = end;
+    }
+    fputc('\n', out);
+}
+
+// Scans one file in place, cluster by cluster, without copying its content anywhere
+static void grep_file(FILE* out, GrepJob* job, const char* pat, int plen){
+    int cluster_count = (job->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if(!cluster_count) return;
+
+    // We need random access to the chain (matches and lines may span clusters), so we collect cluster numbers first
+    int* chain = malloc(cluster_count * sizeof(int));
+    assert(chain && "malloc failed");
+    int cluster = job->start_cluster;
+    for(int i = 0; i < cluster_count; i++){
+        if(cluster < fs->data_start || cluster >= fs->total_cluster){
+            fprintf(out, "grep: %s: broken cluster chain\n", job->path);
+            free(chain);
+            return;
+        }
+        if(verify_cluster(cluster) == -1){
+            fprintf(out, "grep: %s: checksum mismatch on cluster %d\n", job->path, cluster);
+            free(chain);
+            return;
+        }
+        chain[i] = cluster;
+        cluster = fat[cluster];
+    }
+
+    long size = job->size;
+    long pos = 0;           // where the search goes on from
+    long counted = 0;       // newlines before this position have already been counted
+    long line_start = 0;
+    int line = 1;
+
+    while(pos + plen <= size){
+        int index = pos / CLUSTER_SIZE;
+        int offset = pos % CLUSTER_SIZE;
+        long cluster_base = (long)index * CLUSTER_SIZE;
+        int cluster_len = size - cluster_base < CLUSTER_SIZE ? size - cluster_base : CLUSTER_SIZE;
+
+        // First the matches that fit in this cluster, then the ones crossing into the next one
+        long match = -1;
+        int inside = cluster_len - plen + 1 - offset;
+        int hit = inside > 0 ? scan_cluster(chain_at(chain, pos), inside, pat, plen) : -1;
+        if(hit >= 0) match = pos + hit;
+        else{
+            for(long p = inside > 0 ? pos + inside : pos; p < cluster_base + cluster_len && p + plen <= size; p++){
+                if(chain_match(chain, p, pat, plen)){
+                    match = p;
+                    break;
+                }
+            }
+        }
+
+        if(match == -1){
+            pos = cluster_base + cluster_len;
+            continue;
+        }
+
+        // Line number and line boundaries are only worked out when there's something to print
+        long nl;
+        while((nl = chain_find(chain, counted, match, '\n')) != -1){
+            line++;
+            line_start = nl + 1;
+            counted = nl + 1;
+        }
+
+        long line_end = chain_find(chain, match, size, '\n');
+        if(line_end == -1) line_end = size;
+        grep_report(out, job->path, line, chain, line_start, line_end);
+
+        // One report per line is enough, we skip to the next one
+        line++;
+        line_start = line_end + 1;
+        counted = line_end + 1;
+        pos = line_end + 1;
+    }
+
+    free(chain);
+}
+
+static void* grep_worker(void* arg){
+    GrepSearch* search = (GrepSearch*)arg;
+    int i;
+    while((i = __atomic_fetch_add(&search->next_job, 1, __ATOMIC_RELAXED)) < search->job_count){
+        GrepJob* job = &search->jobs[i];
+        FILE* out = open_memstream(&job->out, &job->out_len);
+        assert(out && "open_memstream failed");
+        grep_file(out, job, search->pattern, search->pattern_len);
+        fclose(out);
+    }
+    return NULL;
+}
+
+static void grep_add_job(GrepSearch* search, const char* path, FSEntry* entry){
+    if(search->job_count % 64 == 0){
+        search->jobs = realloc(search->jobs, (search->job_count + 64) * sizeof(GrepJob));
+        assert(search->jobs && "realloc failed");
+    }
+    GrepJob* job = &search->jobs[search->job_count++];
+    job->path = strdup(path);
+    job->start_cluster = entry->start_cluster;
+    job->size = entry->size;
+    job->out = NULL;
+    job->out_len = 0;
+}
+
+// Collects every file below directory <dir_cluster>, <prefix> is the path of the directory
+static int grep_collect(GrepSearch* search, int dir_cluster, const char* prefix, int depth){
+    if(depth >= MAX_DEPTH){
+        fprintf(fs_output(), "grep: %s: too deep\n", prefix);
+        return -1;
+    }
+
+    int cluster = dir_cluster;
+    while(cluster != FAT_EOC){
+        if(check_cluster(cluster, "grep") == -1) return -1;
+        void* cluster_ptr = cluster_at(cluster);
+        FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
+        int entry_count = *(int*)cluster_ptr;
+
+        for(int i = 0; i < entry_count; i++){
+            if(strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) continue;
+
+            char path[MAX_DEPTH * FILENAME_LEN];
+            snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", entries[i].name);
+            if(entries[i].is_dir){
+                if(grep_collect(search, entries[i].start_cluster, path, depth + 1) == -1) return -1;
+                entries = (FSEntry*)(cluster_at(cluster) + sizeof(int));     // the subtree may have pushed it out of the window
+            }
+            else grep_add_job(search, path, &entries[i]);
+        }
+        cluster = fat[cluster];
+    }
+    return 0;
+}
+
+// Looks for <pattern> in file <name>, or in every file below directory <name> if <recursive> is set
+void _grep(const char* pattern, const char* name, int recursive){
+    if(strlen(name) >= FILENAME_LEN){
+        fprintf(fs_output(), "grep: name is too long\n");
+        return;
+    }
+    if(!*pattern){
+        fprintf(fs_output(), "grep: empty pattern\n");
+        return;
+    }
+
+    GrepSearch search = { pattern, strlen(pattern), NULL, 0, 0 };
+
+    // "." is the current directory, there's no entry for it in root
+    if(strcmp(name, ".") == 0){
+        if(!recursive){
+            fprintf(fs_output(), "grep: '.' is a directory\n");
+            return;
+        }
+        if(grep_collect(&search, current_cluster, "", 0) == -1) goto cleanup;
+    }
+    else{
+        int found = 0;
+        int cluster = current_cluster;
+        while(cluster != FAT_EOC && !found){
+            if(check_cluster(cluster, "grep") == -1) return;
+            void* cluster_ptr = cluster_at(cluster);
+            FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
+            int entry_count = *(int*)cluster_ptr;
+
+            for(int i = 0; i < entry_count; i++){
+                if(strcmp(entries[i].name, name) == 0){
+                    found = 1;
+                    if(!entries[i].is_dir) grep_add_job(&search, name, &entries[i]);
+                    else if(!recursive){
+                        fprintf(fs_output(), "grep: '%s' is a directory\n", name);
+                        return;
+                    }
+                    else if(grep_collect(&search, entries[i].start_cluster, name, 0) == -1) goto cleanup;
+                    break;
+                }
+            }
+            cluster = fat[cluster];
+        }
+        if(!found){
+            fprintf(fs_output(), "grep: '%s' not found\n", name);
+            return;
+        }
+    }
+
+    // Files are spread among threads, results are printed in the order files were found. A backend whose buffers
+    // may be recycled under another thread gets a single one
+    int thread_count = backend->concurrent ? worker_count(search.job_count) : 1;
+    pthread_t threads[MAX_THREADS];
+    for(int t = 0; t < thread_count; t++)
+        assert(!pthread_create(&threads[t], NULL, grep_worker, &search) && "pthread_create failed");
+    for(int t = 0; t < thread_count; t++)
+        assert(!pthread_join(threads[t], NULL) && "pthread_join failed");
+
+    for(int i = 0; i < search.job_count; i++)
+        fwrite(search.jobs[i].out, 1, search.jobs[i].out_len, fs_output());
+
+cleanup:
+    for(int i = 0; i < search.job_count; i++){
+        free(search.jobs[i].path);
+        free(search.jobs[i].out);
+    }
+    free(search.jobs);
+}
+
+// Where cluster <cluster> ended up after grow_fs moved it out of the FAT's way
+static int relocated(int cluster, int old_data_start, int new_data_start, int* moved_to){
+    if(cluster >= old_data_start && cluster < new_data_start && moved_to[cluster - old_data_start] != -1)
+        return moved_to[cluster - old_data_start];
+    return cluster;
+}
+
+// Returns -1 if relocate_entries couldn't get through the whole tree below <dir_cluster>: too deep (or looping back
+// on itself) or leaving the data area. Walks the image as it is now, before anything moves
+static int relocation_reachable(int dir_cluster, int depth){
+    if(depth >= MAX_DEPTH) return -1;
+
+    int cluster = dir_cluster;
+    while(cluster != FAT_EOC){
+        if(cluster < fs->data_start || cluster >= fs->total_cluster) return -1;
+        FSEntry* entries = (FSEntry*)(cluster_at(cluster) + sizeof(int));
+        int entry_count = *(int*)cluster_at(cluster);
+        for(int i = 0; i < entry_count; i++){
+            if(entries[i].is_dir && strcmp(entries[i].name, ".") != 0 && strcmp(entries[i].name, "..") != 0){
+                if(relocation_reachable(entries[i].start_cluster, depth + 1) == -1) return -1;
+                entries = (FSEntry*)(cluster_at(cluster) + sizeof(int));     // the subtree may have pushed it out of the window
+            }
+        }
+        cluster = fat[cluster];
+    }
+    return 0;
+}
+
+// Rewrites every entry below directory <dir_cluster> that points to a relocated cluster
+static void relocate_entries(int dir_cluster, int* new_fat, uint32_t* new_crc, int old_data_start, int new_data_start, int* moved_to, int depth){
+    assert(depth < MAX_DEPTH && "grow planned for a shallower tree");
+
+    int cluster = dir_cluster;
+    while(cluster != FAT_EOC){
+        void* cluster_ptr = cluster_at(cluster);
+        FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
+        int entry_count = *(int*)cluster_ptr;
+        int changed = 0;
+
+        for(int i = 0; i < entry_count; i++){
+            int target = relocated(entries[i].start_cluster, old_data_start, new_data_start, moved_to);
+            if(target != entries[i].start_cluster){
+                entries[i].start_cluster = target;
+                changed = 1;
+            }
+            if(entries[i].is_dir && strcmp(entries[i].name, ".") != 0 && strcmp(entries[i].name, "..") != 0){
+                relocate_entries(entries[i].start_cluster, new_fat, new_crc, old_data_start, new_data_start, moved_to, depth + 1);
+                cluster_ptr = cluster_at(cluster);      // the subtree may have pushed it out of the window
+                entries = (FSEntry*)(cluster_ptr + sizeof(int));
+            }
+        }
+
+        if(changed){
+            mark_dirty(cluster);
+            if(new_crc) new_crc[cluster] = crc32c(cluster_ptr, CLUSTER_SIZE);
+        }
+        cluster = new_fat[cluster];
+    }
+}
+
+// Enlarges the open FS to <new_size> bytes. The FAT (and checksum table) need more clusters, so the few
+// data clusters sitting right after them are moved to the new space, everything else stays where it is
+void grow_fs(int new_size){
+    if(!backend->resize){
+        fprintf(fs_output(), "grow: not supported by the %s backend\n", backend->name);
+        return;
+    }
+
+    int old_total = fs->total_cluster;
+    int new_total = new_size / CLUSTER_SIZE;
+    if(new_total <= old_total){
+        fprintf(fs_output(), "grow: new size must be bigger than current size (%d B)\n", old_total * CLUSTER_SIZE);
+        return;
+    }
+
+    int checksums = fs->crc_start != 0;
+    int fat_clusters = (new_total * sizeof(int) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int new_crc_start = fs->fat_start + fat_clusters;
+    int new_data_start = new_crc_start + (checksums ? fat_clusters : 0);
+    int old_data_start = fs->data_start;
+
+    // We plan everything on copies of FAT and checksum table first, so that if we fail nothing has been touched
+    int* new_fat = calloc(new_total, sizeof(int));
+    uint32_t* new_crc = checksums ? calloc(new_total, sizeof(uint32_t)) : NULL;
+    int* moved_to = malloc((new_data_start - old_data_start) * sizeof(int));
+    assert(new_fat && (new_crc || !checksums) && moved_to && "malloc failed");
+    memcpy(new_fat, fat, old_total * sizeof(int));
+    if(checksums) memcpy(new_crc, crc, old_total * sizeof(uint32_t));
+
+    int moved_count = 0;
+    int free_cursor = new_data_start;
+    for(int c = old_data_start; c < new_data_start; c++){
+        moved_to[c - old_data_start] = -1;
+        if(c >= old_total || new_fat[c] == 0) continue;
+
+        while(free_cursor < new_total && new_fat[free_cursor] != 0) free_cursor++;
+        if(free_cursor == new_total){
+            fprintf(fs_output(), "grow: not enough space to make room for the FAT, try a bigger size\n");
+            free(new_fat);
+            free(new_crc);
+            free(moved_to);
+            return;
+        }
+
+        int dest = free_cursor++;
+        moved_to[c - old_data_start] = dest;
+        new_fat[dest] = new_fat[c];
+        new_fat[c] = 0;
+        if(checksums) new_crc[dest] = new_crc[c];
+        moved_count++;
+    }
+
+    // Entries pointing to moved clusters must all be found, one left behind would end up under the new FAT
+    if(moved_count && relocation_reachable(fs->root_cluster, 0) == -1){
+        fprintf(fs_output(), "grow: directory tree deeper than %d levels or broken, can't relocate it\n", MAX_DEPTH);
+        free(new_fat);
+        free(new_crc);
+        free(moved_to);
+        return;
+    }
+
+    // Chain links pointing to moved clusters now point to their new position
+    for(int i = new_data_start; i < new_total; i++){
+        if(new_fat[i] > 0)
+            new_fat[i] = relocated(new_fat[i], old_data_start, new_data_start, moved_to);
+    }
+
+    // Now the file can grow, existing clusters keep their offset so nothing else has to be copied
+    fs_data = backend->resize(storage, new_size);
+    fs_size = new_size;
+    fs = (FileSystem *)fs_data;
+    if(dirty_bits) dirty_resize(new_total);
+
+    for(int c = old_data_start; c < new_data_start; c++){
+        int dest = moved_to[c - old_data_start];
+        if(dest != -1){
+            memcpy(cluster_at(dest), cluster_at(c), CLUSTER_SIZE);
+            mark_dirty(dest);
+        }
+    }
+
+    int root = relocated(fs->root_cluster, old_data_start, new_data_start, moved_to);
+    relocate_entries(root, new_fat, new_crc, old_data_start, new_data_start, moved_to, 0);
+
+    // New clusters are all zeroes, they all share the same checksum
+    if(checksums){
+        char zero[CLUSTER_SIZE] = {0};
+        uint32_t zero_crc = crc32c(zero, CLUSTER_SIZE);
+        for(int i = old_total; i < new_total; i++)
+            if(!new_fat[i]) new_crc[i] = zero_crc;
+    }
+
+    // FAT and checksum table go in place over the clusters we just emptied
+    memset((char*)fs_data + CLUSTER_SIZE * fs->fat_start, 0, CLUSTER_SIZE * (new_data_start - fs->fat_start));
+    memcpy((char*)fs_data + CLUSTER_SIZE * fs->fat_start, new_fat, new_total * sizeof(int));
+    if(checksums) memcpy((char*)fs_data + CLUSTER_SIZE * new_crc_start, new_crc, new_total * sizeof(uint32_t));
+
+    fs->total_cluster = new_total;
+    fs->root_cluster = root;
+    fs->data_start = new_data_start;
+    fs->crc_start = checksums ? new_crc_start : 0;
+
+    fat = (int *)(fs_data + CLUSTER_SIZE * fs->fat_start);
+    crc = checksums ? (uint32_t *)(fs_data + CLUSTER_SIZE * fs->crc_start) : NULL;
+
+    // Boot sector and FAT changed, their checksums have to follow
+    for(int i = 0; i < fs->crc_start; i++)
+        cluster_changed(i);
+    for(int i = fs->crc_start; i < fs->data_start; i++)
+        mark_dirty(i);
+
+    current_cluster = relocated(current_cluster, old_data_start, new_data_start, moved_to);
+    current_dir = (FSEntry *)(cluster_at(current_cluster) + sizeof(int));
+    current_entry_count = *(int *)(cluster_at(current_cluster));
+
+    free(new_fat);
+    free(new_crc);
+    free(moved_to);
+
+    fprintf(fs_output(), "grow: %d -> %d clusters, %d relocated\n", old_total, new_total, moved_count);
+}
+
+typedef struct ExportHeader{
+    char magic[8];
+    int cluster_size;
+    int total_cluster;
+    int meta_clusters;      // boot sector + FAT + checksum table, written as they are
+} ExportHeader;
+
+// Writes a compact copy of the open FS to <out_filename>: boot sector, FAT and checksums,
+// then only allocated clusters, grouped in runs of consecutive clusters
+void export_image(const char* out_filename){
+    FILE* out = fopen(out_filename, "wb");
+    if(!out){
+        fprintf(fs_output(), "export-image: can't create '%s'\n", out_filename);
+        return;
+    }
+
+    fat_checksums();      // the checksum table goes out as it is
+    ExportHeader header = { EXPORT_MAGIC, CLUSTER_SIZE, fs->total_cluster, fs->data_start };
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(fs_data, CLUSTER_SIZE, fs->data_start, out);
+
+    int run_count = 0;
+    int cluster_count = 0;
+    int i = fs->data_start;
+    while(i < fs->total_cluster){
+        if(fat[i] == 0){
+            i++;
+            continue;
+        }
+
+        int run[2] = { i, 0 };      // first cluster, length
+        while(i + run[1] < fs->total_cluster && fat[i + run[1]] != 0) run[1]++;
+        fwrite(run, sizeof(run), 1, out);
+        for(int c = i; c < i + run[1]; c++)
+            fwrite(cluster_at(c), CLUSTER_SIZE, 1, out);
+
+        run_count++;
+        cluster_count += run[1];
+        i += run[1];
+    }
+
+    int end[2] = { 0, 0 };
+    fwrite(end, sizeof(end), 1, out);
+
+    if(fclose(out) != 0){
+        fprintf(fs_output(), "export-image: write error on '%s'\n", out_filename);
+        return;
+    }
+    fprintf(fs_output(), "export-image: %d of %d clusters in %d runs\n", cluster_count + fs->data_start, fs->total_cluster, run_count);
+}
+
+// Rebuilds image <fs_filename> from a stream written by export_image, free clusters are left as holes
+void import_image(const char* in_filename, const char* fs_filename){
+    FILE* in = fopen(in_filename, "rb");
+    if(!in){
+        fprintf(fs_output(), "import-image: can't open '%s'\n", in_filename);
+        return;
+    }
+
+    ExportHeader header;
+    if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, EXPORT_MAGIC, sizeof(header.magic)) != 0
+       || header.cluster_size != CLUSTER_SIZE || header.meta_clusters <= 0 || header.meta_clusters >= header.total_cluster){
+        fprintf(fs_output(), "import-image: '%s' is not an exported image\n", in_filename);
+        fclose(in);
+        return;
+    }
+
+    int fd = open(fs_filename, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0){
+        fprintf(fs_output(), "import-image: file system '%s' already exists\n", fs_filename);
+        fclose(in);
+        return;
+    }
+    assert(!ftruncate(fd, (off_t)header.total_cluster * CLUSTER_SIZE) && "ftruncate failed");
+
+    char* buffer = malloc(CLUSTER_SIZE * header.meta_clusters);
+    assert(buffer && "malloc failed");
+    int ok = fread(buffer, CLUSTER_SIZE, header.meta_clusters, in) == header.meta_clusters;
+    if(ok) assert(pwrite(fd, buffer, CLUSTER_SIZE * header.meta_clusters, 0) == CLUSTER_SIZE * header.meta_clusters && "pwrite failed");
+    free(buffer);
+
+    int run[2];
+    while(ok && (ok = fread(run, sizeof(run), 1, in) == 1) && run[1] != 0){
+        if(run[0] < header.meta_clusters || run[1] < 0 || run[0] + run[1] > header.total_cluster){
+            ok = 0;
+            break;
+        }
+        buffer = malloc((size_t)CLUSTER_SIZE * run[1]);
+        assert(buffer && "malloc failed");
+        ok = fread(buffer, CLUSTER_SIZE, run[1], in) == run[1];
+        if(ok) assert(pwrite(fd, buffer, (size_t)CLUSTER_SIZE * run[1], (off_t)run[0] * CLUSTER_SIZE) == (ssize_t)CLUSTER_SIZE * run[1] && "pwrite failed");
+        free(buffer);
+    }
+
+    fclose(in);
+    assert(!close(fd) && "file close failed");
+    if(!ok){
+        fprintf(fs_output(), "import-image: '%s' is truncated or corrupted\n", in_filename);
+        unlink(fs_filename);
+    }
+}
+
+typedef struct SyncTask{
+    char* src;
+    char* dst;
+    int* src_fat;
+    int* dst_fat;       // NULL if dst has been wiped, then free clusters are zero on both sides
+    int meta_clusters;
+    int first;          // first cluster to compare
+    int last;           // one past the last cluster to compare
+    int compared;
+    int copied;
+} SyncTask;
+
+static void* sync_worker(void* arg){
+    SyncTask* task = (SyncTask*)arg;
+    for(int i = task->first; i < task->last; i++){
+        // Clusters free on both sides are zero on both sides, nothing to look at
+        int live = i < task->meta_clusters || task->src_fat[i] != 0 || (task->dst_fat && task->dst_fat[i] != 0);
+        if(!live) continue;
+
+        char* from = task->src + (size_t)CLUSTER_SIZE * i;
+        char* to = task->dst + (size_t)CLUSTER_SIZE * i;
+        task->compared++;
+        // Both sides have to be read anyway, a plain comparison is all it takes (and stops at the first difference)
+        if(memcmp(from, to, CLUSTER_SIZE) != 0){
+            memcpy(to, from, CLUSTER_SIZE);
+            task->copied++;
+        }
+    }
+    return NULL;
+}
+
+// Returns 1 if the boot sector at <image> describes a file system fitting in <size> bytes
+static int looks_like_fs(const char* image, off_t size){
+    FileSystem* sb = (FileSystem*)image;
+    return size >= CLUSTER_SIZE && sb->total_cluster > 0 && (off_t)sb->total_cluster * CLUSTER_SIZE <= size && sb->fat_start > 0
+           && sb->data_start > sb->fat_start && sb->data_start < sb->total_cluster
+           && (sb->crc_start == 0 || (sb->crc_start > sb->fat_start && sb->crc_start < sb->data_start));
+}
+
+// Makes image <dst_filename> identical to <src_filename>, copying only the clusters that differ. An existing
+// <dst_filename> must be a file system with the same geometry, unless <force> allows to overwrite it from scratch
+void sync_image(const char* src_filename, const char* dst_filename, int force){
+    int src_fd = open(src_filename, O_RDONLY);
+    if(src_fd < 0){
+        fprintf(fs_output(), "sync-image: file system '%s' does not exist\n", src_filename);
+        return;
+    }
+    int dst_fd = open(dst_filename, O_CREAT | O_RDWR, 0600);
+    if(dst_fd < 0){
+        fprintf(fs_output(), "sync-image: can't open '%s'\n", dst_filename);
+        close(src_fd);
+        return;
+    }
+
+    struct stat src_st, dst_st;
+    assert(fstat(src_fd, &src_st) == 0 && fstat(dst_fd, &dst_st) == 0 && "fstat failed");
+    if(src_st.st_ino == dst_st.st_ino && src_st.st_dev == dst_st.st_dev){
+        fprintf(fs_output(), "sync-image: source and destination are the same file\n");
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+
+    char* src = mmap(NULL, src_st.st_size, PROT_READ, MAP_SHARED, src_fd, 0);
+    assert(src != MAP_FAILED && "mmap failed");
+    FileSystem* src_fs = (FileSystem*)src;
+    if(!looks_like_fs(src, src_st.st_size)){
+        fprintf(fs_output(), "sync-image: '%s' is not a file system\n", src_filename);
+        assert(!munmap(src, src_st.st_size) && "munmap failed");
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+    int* src_fat = (int*)(src + CLUSTER_SIZE * src_fs->fat_start);
+
+    // dst must be an older copy of src: same size and same layout. An empty file is a brand new copy,
+    // anything else is only wiped if we've been told to
+    int same_geometry = 0;
+    if(dst_st.st_size == src_st.st_size){
+        FileSystem dst_sb;
+        same_geometry = pread(dst_fd, &dst_sb, sizeof(dst_sb), 0) == sizeof(dst_sb) && dst_sb.total_cluster == src_fs->total_cluster
+                        && dst_sb.fat_start == src_fs->fat_start && dst_sb.crc_start == src_fs->crc_start
+                        && dst_sb.data_start == src_fs->data_start;
+    }
+    if(!same_geometry && dst_st.st_size != 0 && !force){
+        fprintf(fs_output(), "sync-image: '%s' is not a copy of '%s' (use --force to overwrite it)\n", dst_filename, src_filename);
+        assert(!munmap(src, src_st.st_size) && "munmap failed");
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+    if(!same_geometry){
+        // Wiped, every cluster of it is free
+        assert(!ftruncate(dst_fd, 0) && !ftruncate(dst_fd, src_st.st_size) && "ftruncate failed");
+    }
+    char* dst = mmap(NULL, src_st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, 0);
+    assert(dst != MAP_FAILED && "mmap failed");
+    FileSystem* dst_fs = (FileSystem*)dst;
+
+    // dst FAT is part of what gets synced, so workers get a copy taken before anything changes
+    int* dst_fat = NULL;
+    if(same_geometry){
+        dst_fat = malloc(src_fs->total_cluster * sizeof(int));
+        assert(dst_fat && "malloc failed");
+        memcpy(dst_fat, dst + CLUSTER_SIZE * dst_fs->fat_start, src_fs->total_cluster * sizeof(int));
+    }
+
+    // Data first, boot sector and FAT last: until then dst keeps pointing at its own clusters
+    int thread_count = worker_count(src_fs->total_cluster);
+    pthread_t threads[MAX_THREADS];
+    SyncTask tasks[MAX_THREADS];
+    int data_clusters = src_fs->total_cluster - src_fs->data_start;
+    int per_thread = (data_clusters + thread_count - 1) / thread_count;
+    for(int t = 0; t < thread_count; t++){
+        int first = src_fs->data_start + t * per_thread;
+        int last = first + per_thread < src_fs->total_cluster ? first + per_thread : src_fs->total_cluster;
+        tasks[t] = (SyncTask){ src, dst, src_fat, dst_fat, src_fs->data_start, first, last, 0, 0 };
+        assert(!pthread_create(&threads[t], NULL, sync_worker, &tasks[t]) && "pthread_create failed");
+    }
+
+    int compared = 0, copied = 0;
+    for(int t = 0; t < thread_count; t++){
+        assert(!pthread_join(threads[t], NULL) && "pthread_join failed");
+        compared += tasks[t].compared;
+        copied += tasks[t].copied;
+    }
+
+    SyncTask meta = { src, dst, src_fat, dst_fat, src_fs->data_start, 0, src_fs->data_start, 0, 0 };
+    sync_worker(&meta);
+    compared += meta.compared;
+    copied += meta.copied;
+
+    assert(!msync(dst, src_st.st_size, MS_SYNC) && "msync failed");
+    free(dst_fat);
+    assert(!munmap(src, src_st.st_size) && !munmap(dst, src_st.st_size) && "munmap failed");
+    close(src_fd);
+    close(dst_fd);
+
+    fprintf(fs_output(), "sync-image: %d clusters compared, %d copied (%d KB)\n", compared, copied, copied * CLUSTER_SIZE / 1024);
+}
+
+// End of a command: pointers to clusters handed out so far are not used anymore, in any mount
+// (a cp may have left changes in a parked one)
+void fs_release(){
+    if(backend){
+        fat_checksums();
+        backend->release(storage);
+    }
+    for(int i = 0; i < mount_count; i++)
+        if(i != active_mount) mounts[i].storage->backend->release(mounts[i].storage);
+}
+// Keeps the dirty bitmap as big as the image, bits already set stay set
+static void dirty_resize(int cluster_count){
+    int words = (cluster_count + 63) / 64;
+    pthread_mutex_lock(&writeback_lock);
+    dirty_bits = realloc(dirty_bits, words * sizeof(uint64_t));
+    assert(dirty_bits && "realloc failed");
+    if(words > dirty_words) memset(dirty_bits + dirty_words, 0, (words - dirty_words) * sizeof(uint64_t));
+    dirty_words = words;
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+static int dirty_count(){
+    int count = 0;
+    for(int i = 0; i < dirty_words; i++)
+        count += __builtin_popcountll(__atomic_load_n(&dirty_bits[i], __ATOMIC_RELAXED));
+    return count;
+}
+
+// One flusher pass: takes dirty runs starting from the cursor and hands them to the backend,
+// until about <budget> clusters are on their way. Called with writeback_lock held
+static void writeback_pass(int budget){
+    int run_start = -1, run_len = 0;
+    for(int n = 0; n < dirty_words && budget > 0; n++){
+        int w = writeback_cursor;
+        writeback_cursor = (writeback_cursor + 1) % dirty_words;
+        // Bits are taken before writing, a cluster changed again meanwhile will simply be in the next pass
+        uint64_t bits = __atomic_exchange_n(&dirty_bits[w], 0, __ATOMIC_RELAXED);
+
+        for(int b = 0; b < 64; b++){
+            int cluster = w * 64 + b;
+            if(bits & (1ULL << b)){
+                if(run_len && run_start + run_len == cluster) run_len++;
+                else{
+                    if(run_len) backend->writeback(storage, run_start, run_len);
+                    run_start = cluster;
+                    run_len = 1;
+                }
+                budget--;
+            }
+        }
+        // Runs don't wrap around the end of the image
+        if(writeback_cursor == 0 && run_len){
+            backend->writeback(storage, run_start, run_len);
+            run_len = 0;
+        }
+    }
+    if(run_len) backend->writeback(storage, run_start, run_len);
+}
+
+static void* writeback_worker(void* arg){
+    pthread_mutex_lock(&writeback_lock);
+    while(!writeback_stop){
+        if(!writeback_ms){
+            pthread_cond_wait(&writeback_wake, &writeback_lock);
+            continue;
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)writeback_ms * 1000000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        if(pthread_cond_timedwait(&writeback_wake, &writeback_lock, &until) == 0) continue;   // woken up: settings changed or stop
+        writeback_pass(writeback_kb * 1024 / CLUSTER_SIZE);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return NULL;
+}
+
+static void writeback_start(){
+    writeback_stop = 0;
+    writeback_cursor = 0;
+    assert(!pthread_create(&writeback_thread, NULL, writeback_worker, NULL) && "pthread_create failed");
+    writeback_running = 1;
+}
+
+static void writeback_stop_thread(){
+    if(!writeback_running) return;
+    pthread_mutex_lock(&writeback_lock);
+    writeback_stop = 1;
+    pthread_cond_signal(&writeback_wake);
+    pthread_mutex_unlock(&writeback_lock);
+    assert(!pthread_join(writeback_thread, NULL) && "pthread_join failed");
+    writeback_running = 0;
+}
+
+// Changes the flusher rate (every <ms> milliseconds, up to <kb> KB per pass, <ms> = 0 pauses it) and shows
+// the current state. Negative values leave the setting as it is
+void writeback_set(int ms, int kb){
+    pthread_mutex_lock(&writeback_lock);
+    if(ms >= 0) writeback_ms = ms;
+    if(kb > 0) writeback_kb = kb;
+    pthread_cond_signal(&writeback_wake);
+    int dirty = dirty_count();
+    pthread_mutex_unlock(&writeback_lock);
+
+    if(!backend->writeback)
+        fprintf(fs_output(), "writeback: the %s backend schedules its own writes\n", backend->name);
+    else if(!writeback_ms)
+        fprintf(fs_output(), "writeback: paused, %d clusters dirty\n", dirty);
+    else
+        fprintf(fs_output(), "writeback: every %d ms, up to %d KB per pass, %d clusters dirty\n", writeback_ms, writeback_kb, dirty);
+}
+
+// Flushes <s> and clears its dirty bitmap, returns how many clusters were still dirty. Called with writeback_lock held
+static int flush_storage(Storage *s, uint64_t *bits, int words){
+    // Bits are taken before flushing: a cluster marked while the flush runs stays dirty for the next round
+    int dirty = 0;
+    for(int i = 0; i < words; i++)
+        dirty += __builtin_popcountll(__atomic_exchange_n(&bits[i], 0, __ATOMIC_RELAXED));
+    s->backend->flush(s);
+    return dirty;
+}
+
+// Durability barrier: once this returns every change made so far is on disk, parked mounts included
+void sync_fs(){
+    fat_checksums();
+    pthread_mutex_lock(&writeback_lock);
+    int dirty = flush_storage(storage, dirty_bits, dirty_words);
+    int flushed = 1, scheduled = backend->writeback != NULL;
+    for(int i = 0; i < mount_count; i++){
+        if(i == active_mount) continue;
+        dirty += flush_storage(mounts[i].storage, mounts[i].dirty_bits, mounts[i].dirty_words);
+        flushed++;
+        if(mounts[i].storage->backend->writeback) scheduled = 1;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    if(scheduled && flushed > 1) fprintf(fs_output(), "sync: done, %d images, %d clusters were still dirty\n", flushed, dirty);
+    else if(scheduled) fprintf(fs_output(), "sync: done, %d clusters were still dirty\n", dirty);
+}
+
+// Moves the open image out of the globals into <m>
+static void park_mount(Mount *m){
+    fat_checksums();        // pending FAT clusters belong to this image
+    m->storage = storage;
+    m->fs_data = fs_data;
+    m->fs = fs;
+    m->fs_fd = fs_fd;
+    m->fs_size = fs_size;
+    m->fat = fat;
+    m->crc = crc;
+    m->current_dir = current_dir;
+    m->current_cluster = current_cluster;
+    m->current_entry_count = current_entry_count;
+    m->dirty_bits = dirty_bits;
+    m->dirty_words = dirty_words;
+    m->writeback_cursor = writeback_cursor;
+
+    backend = NULL;
+    storage = NULL;
+    fs_data = NULL;
+    fs = NULL;
+    fs_fd = -1;
+    fs_size = -1;
+    fat = NULL;
+    crc = NULL;
+    current_dir = NULL;
+    dirty_bits = NULL;
+    dirty_words = 0;
+}
+
+static void unpark_mount(Mount *m){
+    storage = m->storage;
+    backend = storage->backend;
+    fs_data = m->fs_data;
+    fs = m->fs;
+    fs_fd = m->fs_fd;
+    fs_size = m->fs_size;
+    fat = m->fat;
+    crc = m->crc;
+    current_dir = m->current_dir;
+    current_cluster = m->current_cluster;
+    current_entry_count = m->current_entry_count;
+    dirty_bits = m->dirty_bits;
+    dirty_words = m->dirty_words;
+    writeback_cursor = m->writeback_cursor;
+}
+
+// Puts mount <index> (-1 = none) in the globals. The flusher must not be running, it works on the globals too.
+// The working directory is saved and restored from the calling thread, so only the thread that mounted may switch
+// (server clients never get past the early return: the server opens its image without mounting it)
+static void switch_mount(int index){
+    if(index == active_mount) return;
+    assert(pthread_equal(pthread_self(), mount_owner) && "mounts switched outside the shell thread");
+    if(active_mount != -1) park_mount(&mounts[active_mount]);
+    if(index != -1) unpark_mount(&mounts[index]);
+    active_mount = index;
+}
+
+// Same as switch_mount, for switches that last: the flusher follows the active image
+static void activate_mount(int index){
+    writeback_stop_thread();
+    switch_mount(index);
+    if(backend && backend->writeback) writeback_start();
+}
+
+// Opens <fs_filename> as mount <name> and makes it the active one. Returns the same codes as open_fs,
+// -3 if the name or the image are already mounted, -4 if there are too many mounts
+int mount_fs(const char *name, const char *fs_filename, const Backend *with, const BackendOptions *options){
+    struct stat st;
+    if(stat(fs_filename, &st) == -1) return -1;
+    if(mount_count == MAX_MOUNTS) return -4;
+    for(int i = 0; i < mount_count; i++)
+        if(strcmp(mounts[i].name, name) == 0 || (mounts[i].dev == st.st_dev && mounts[i].ino == st.st_ino)) return -3;
+
+    if(!mount_count) mount_owner = pthread_self();
+    int previous = active_mount;
+    activate_mount(-1);
+    int result = open_fs(fs_filename, with, options);
+    if(result != 0){
+        activate_mount(previous);
+        return result;
+    }
+
+    Mount *m = &mounts[mount_count];
+    memset(m, 0, sizeof(*m));
+    strncpy(m->name, name, FILENAME_LEN - 1);
+    strncpy(m->image, fs_filename, sizeof(m->image) - 1);
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    active_mount = mount_count++;
+    return 0;
+}
+
+// Makes mount <name> the active one, returns -1 if there's no such mount
+int use_fs(const char *name){
+    for(int i = 0; i < mount_count; i++){
+        if(strcmp(mounts[i].name, name) == 0){
+            activate_mount(i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Closes mount <name> (the active one if NULL), returns -1 if there's no such mount.
+// If it was the active one the first of the others (if any) takes its place
+int unmount_fs(const char *name){
+    int index = active_mount;
+    if(name){
+        for(index = mount_count - 1; index >= 0 && strcmp(mounts[index].name, name); index--);
+        if(index == -1) return -1;
+    }
+
+    // A parked mount is closed where it is, the active one stays in the globals
+    if(index != active_mount){
+        Mount *m = &mounts[index];
+        close_storage(m->storage, m->fs_fd, m->dirty_bits);
+        mounts[index] = mounts[--mount_count];
+        if(active_mount == mount_count) active_mount = index;      // the last mount has just moved into the hole
+        return 0;
+    }
+
+    close_fs();
+    active_mount = -1;
+    mounts[index] = mounts[--mount_count];
+    if(mount_count) activate_mount(0);
+    return 0;
+}
+
+// Closes every mount, parked ones first (shutdown)
+void unmount_all(){
+    for(int i = 0; i < mount_count; i++)
+        if(i != active_mount) close_storage(mounts[i].storage, mounts[i].fs_fd, mounts[i].dirty_bits);
+    if(active_mount != -1) close_fs();
+    mount_count = 0;
+    active_mount = -1;
+}
+
+// Returns 1 if commands that only read can run side by side on the open image
+int concurrent_readers(){
+    return backend && backend->concurrent;
+}
+
+// Image file of the active mount, NULL if nothing is mounted
+const char *mounted_image(){
+    return active_mount == -1 ? NULL : mounts[active_mount].image;
+}
+
+void list_mounts(){
+    for(int i = 0; i < mount_count; i++){
+        const Backend *b = i == active_mount ? backend : mounts[i].storage->backend;
+        fprintf(fs_output(), "%c %-12s %s (%s)\n", i == active_mount ? '*' : ' ', mounts[i].name, mounts[i].image, b->name);
+    }
+}
+
+typedef struct CopyJob{
+    int from;           // source and destination mounts (the same one to copy inside an image)
+    int to;
+    int next_free;      // destination cluster the search for free space goes on from
+    int files;
+    int dirs;
+    long clusters;
+} CopyJob;
+
+// Looks for <name> in directory <dir> of the active mount and copies its entry in <found>.
+// Returns 0 if found, -1 if not, -2 if the directory is broken
+static int lookup(int dir, const char *name, FSEntry *found, const char *cmd){
+    // root has no "..", it is its own parent
+    if(dir == fs->root_cluster && strcmp(name, "..") == 0) name = ".";
+
+    int cluster = dir;
+    while(cluster != FAT_EOC){
+        if(check_cluster(cluster, cmd) == -1) return -2;
+        char *cluster_ptr = cluster_at(cluster);
+        FSEntry *entries = (FSEntry *)(cluster_ptr + sizeof(int));
+        int entry_count = *(int *)cluster_ptr;
+        for(int i = 0; i < entry_count; i++){
+            if(strcmp(entries[i].name, name) == 0){
+                *found = entries[i];
+                return 0;
+            }
+        }
+        cluster = fat[cluster];
+    }
+    return -1;
+}
+
+// Follows <path> (absolute, or relative to the working directory) in the active mount. The last component is
+// looked up in the directory it ends in (<parent>), its entry goes in <found> and its name in <last>.
+// Returns 0 if it exists, -1 if only its parent does, -2 if the path is broken. Paths with no last component
+// ("/", "" or ending in "." / "..") give the directory itself with an empty <last>
+static int resolve_path(const char *path, int *parent, FSEntry *found, char *last, const char *cmd){
+    char copy[MAX_DEPTH * FILENAME_LEN];
+    if(strlen(path) >= sizeof(copy)){
+        fprintf(fs_output(), "%s: path too long\n", cmd);
+        return -2;
+    }
+    strcpy(copy, path);
+
+    int dir = path[0] == '/' ? fs->root_cluster : current_cluster;
+    char *save;
+    char *name = strtok_r(copy, "/", &save);
+    last[0] = '\0';
+    while(name){
+        char *next = strtok_r(NULL, "/", &save);
+        if(strlen(name) >= FILENAME_LEN){
+            fprintf(fs_output(), "%s: name too long\n", cmd);
+            return -2;
+        }
+        int result = lookup(dir, name, found, cmd);
+        if(result == -2) return -2;
+        if(!next){
+            *parent = dir;
+            if(result == -1 || (strcmp(name, ".") && strcmp(name, ".."))){
+                strcpy(last, name);
+                return result;
+            }
+        }
+        if(result == -1){
+            fprintf(fs_output(), "%s: '%s' not found\n", cmd, name);
+            return -2;
+        }
+        if(!found->is_dir){
+            fprintf(fs_output(), "%s: '%s' is not a directory\n", cmd, name);
+            return -2;
+        }
+        dir = found->start_cluster;
+        name = next;
+    }
+
+    found->is_dir = 1;
+    found->start_cluster = dir;
+    found->size = 0;
+    found->name[0] = '\0';
+    *parent = dir;
+    return 0;
+}
+
+// Returns 1 if directory <dir> is <ancestor> or somewhere below it (in the active mount)
+static int inside(int dir, int ancestor){
+    for(int depth = 0; depth < MAX_DEPTH; depth++){
+        if(dir == ancestor) return 1;
+        if(dir == fs->root_cluster) return 0;
+        FSEntry parent;
+        if(lookup(dir, "..", &parent, "cp") != 0) return 1;     // can't tell, better not copy
+        dir = parent.start_cluster;
+    }
+    return 1;
+}
+
+// Length of the free run starting at the first free cluster from job->next_free (wrapping around once),
+// at most <wanted> long. The run starts at *start, 0 if the destination is full
+static int free_run(CopyJob *job, int wanted, int *start){
+    for(int pass = 0; pass < 2; pass++){
+        int from = pass ? fs->data_start : job->next_free;
+        int to = pass ? job->next_free : fs->total_cluster;
+        for(int i = from; i < to; i++){
+            if(fat[i]) continue;
+            int len = 1;
+            while(len < wanted && i + len < fs->total_cluster && !fat[i + len]) len++;
+            *start = i;
+            job->next_free = i + len;
+            return len;
+        }
+    }
+    return 0;
+}
+
+// FAT entries <first>..<last> have been written directly
+static void fat_range_changed(int first, int last){
+    int from = fs->fat_start + first * sizeof(int) / CLUSTER_SIZE;
+    int to = fs->fat_start + last * sizeof(int) / CLUSTER_SIZE;
+    for(int c = from; c <= to; c++)
+        fat_changed(c);
+}
+
+// Copies the chain starting at <src_start> of the source into fresh clusters of the destination, a batch at a time:
+// source clusters are collected, then written into runs of free destination clusters, memcpy'ing as much as the
+// two images have contiguous in memory. Only one batch of pointers is held at a time (less than a window chunk,
+// 32 pread blocks), so a windowed image stays within its window plus a batch and a pread cache never drops them. Returns the first destination cluster (the destination
+// is active), -1 on failure
+static int copy_chain(CopyJob *job, int src_start){
+    char *batch[COPY_BATCH];
+    int first = -1, last = -1;
+    int cluster = src_start;
+
+    while(cluster != FAT_EOC){
+        switch_mount(job->from);
+        backend->release(storage);  // the previous batch is done with
+        int n = 0;
+        while(cluster != FAT_EOC && n < COPY_BATCH){
+            if(cluster < fs->data_start || cluster >= fs->total_cluster || check_cluster(cluster, "cp") == -1){
+                fprintf(fs_output(), "cp: broken source chain, nothing copied for this file\n");
+                n = -1;
+                break;
+            }
+            batch[n++] = cluster_at(cluster);
+            cluster = fat[cluster];
+        }
+
+        switch_mount(job->to);
+        if(n == -1) goto fail;
+        for(int i = 0; i < n; ){
+            int start;
+            int len = free_run(job, n - i, &start);
+            if(!len){
+                fprintf(fs_output(), "cp: no empty space\n");
+                goto fail;
+            }
+
+            for(int k = 0; k < len; ){
+                char *dest = cluster_at(start + k);
+                int same = 1;
+                while(k + same < len && batch[i + k + same] == batch[i + k] + (long)same * CLUSTER_SIZE &&
+                      cluster_at(start + k + same) == dest + (long)same * CLUSTER_SIZE)
+                    same++;
+                memcpy(dest, batch[i + k], (long)same * CLUSTER_SIZE);
+                k += same;
+            }
+
+            for(int k = 0; k < len; k++){
+                fat[start + k] = k + 1 < len ? start + k + 1 : FAT_EOC;
+                cluster_changed(start + k);
+            }
+            fat_range_changed(start, start + len - 1);
+            if(last != -1) set_fat(last, start);
+            else first = start;
+            last = start + len - 1;
+            i += len;
+            job->clusters += len;
+        }
+    }
+    return first;
+
+fail:
+    if(first != -1){
+        for(int c = first; c != FAT_EOC; c = fat[c]) job->clusters--;
+        free_cluster_chain(first);
+    }
+    return -1;
+}
+
+// Adds <entry> to directory <dir> of the active mount
+static int add_entry(int dir, FSEntry *entry){
+    int saved = current_cluster;
+    current_cluster = dir;
+    int result = insert_entry_in_directory(*entry);
+    current_cluster = saved;
+    return result;
+}
+
+// Copies file <entry> of the source into directory <dir> of the destination as <name>. Returns -1 if cp must stop
+static int copy_file(CopyJob *job, FSEntry *entry, int dir, const char *name){
+    FSEntry existing;
+    switch_mount(job->to);
+    if(lookup(dir, name, &existing, "cp") != -1){
+        fprintf(fs_output(), "cp: '%s' already exists\n", name);
+        return 0;
+    }
+
+    int start = copy_chain(job, entry->start_cluster);
+    if(start == -1) return -1;
+
+    FSEntry copy = *entry;
+    strcpy(copy.name, name);
+    copy.start_cluster = start;
+    if(add_entry(dir, &copy) == -1){
+        fprintf(fs_output(), "cp: not enough space to insert '%s'\n", name);
+        free_cluster_chain(start);
+        return -1;
+    }
+    job->files++;
+    return 0;
+}
+
+// Creates directory <name> in <dir> of the destination, returns its cluster or -1
+static int copy_dir_entry(CopyJob *job, int dir, const char *name){
+    FSEntry made;
+    switch_mount(job->to);
+    if(lookup(dir, name, &made, "cp") != -1){
+        fprintf(fs_output(), "cp: '%s' already exists\n", name);
+        return -1;
+    }
+    int saved = current_cluster;
+    current_cluster = dir;
+    _mkdir(name);
+    current_cluster = saved;
+    if(lookup(dir, name, &made, "cp") != 0) return -1;
+    job->dirs++;
+    return made.start_cluster;
+}
+
+// Copies everything in directory <src_dir> of the source into <dst_dir> of the destination
+static int copy_tree(CopyJob *job, int src_dir, int dst_dir, int depth){
+    if(depth >= MAX_DEPTH){
+        fprintf(fs_output(), "cp: too deep\n");
+        return -1;
+    }
+
+    // Entries are copied out, the directory clusters won't be around once we switch to the destination
+    switch_mount(job->from);
+    FSEntry *list = NULL;
+    int count = 0;
+    int cluster = src_dir;
+    while(cluster != FAT_EOC){
+        if(check_cluster(cluster, "cp") == -1){
+            free(list);
+            return -1;
+        }
+        char *cluster_ptr = cluster_at(cluster);
+        FSEntry *entries = (FSEntry *)(cluster_ptr + sizeof(int));
+        int entry_count = *(int *)cluster_ptr;
+        list = realloc(list, (count + entry_count) * sizeof(FSEntry));
+        assert((list || !(count + entry_count)) && "realloc failed");
+        for(int i = 0; i < entry_count; i++)
+            if(strcmp(entries[i].name, ".") && strcmp(entries[i].name, ".."))
+                list[count++] = entries[i];
+        cluster = fat[cluster];
+    }
+
+    int result = 0;
+    for(int i = 0; i < count && result == 0; i++){
+        if(!list[i].is_dir){
+            result = copy_file(job, &list[i], dst_dir, list[i].name);
+            continue;
+        }
+        int sub = copy_dir_entry(job, dst_dir, list[i].name);
+        if(sub != -1) result = copy_tree(job, list[i].start_cluster, sub, depth + 1);
+    }
+    free(list);
+    return result;
+}
+
+// Splits "<mount>:<path>" into mount and path, a path without a mount refers to the active one.
+// Returns -2 if there's no such mount
+static int split_mount(const char *spec, const char **path){
+    const char *colon = strchr(spec, ':');
+    const char *slash = strchr(spec, '/');
+    if(!colon || (slash && slash < colon)){
+        *path = spec;
+        return active_mount;
+    }
+    *path = colon + 1;
+    for(int i = 0; i < mount_count; i++)
+        if(strlen(mounts[i].name) == (size_t)(colon - spec) && strncmp(mounts[i].name, spec, colon - spec) == 0) return i;
+    return -2;
+}
+
+// Copies file or directory tree <src> to <dst>, both may live in any mount ("<mount>:<path>").
+// If <dst> is an existing directory the copy goes inside it
+void _cp(const char *src, const char *dst){
+    const char *src_path, *dst_path;
+    CopyJob job = {0};
+    job.from = split_mount(src, &src_path);
+    job.to = split_mount(dst, &dst_path);
+    if(job.from == -2 || job.to == -2){
+        const char *bad = job.from == -2 ? src : dst;
+        fprintf(fs_output(), "cp: no file system mounted as '%.*s'\n", (int)(strchr(bad, ':') - bad), bad);
+        return;
+    }
+
+    int home = active_mount;
+    writeback_stop_thread();    // we're going to swap the globals back and forth
+
+    int src_parent, dst_parent;
+    FSEntry src_entry, dst_entry;
+    char src_name[FILENAME_LEN], dst_name[FILENAME_LEN];
+
+    switch_mount(job.from);
+    if(resolve_path(src_path, &src_parent, &src_entry, src_name, "cp") != 0){
+        if(src_name[0]) fprintf(fs_output(), "cp: '%s' not found\n", src_path);
+        goto done;
+    }
+
+    switch_mount(job.to);
+    job.next_free = fs->data_start;
+    int found = resolve_path(dst_path, &dst_parent, &dst_entry, dst_name, "cp");
+    if(found == -2) goto done;
+
+    // Where the copy goes: inside <dst> if it is a directory, as <dst> otherwise.
+    // A source with no name of its own (like "a:/") has its content copied
+    int dir;
+    const char *name;
+    if(found == 0 && dst_entry.is_dir){
+        dir = dst_entry.start_cluster;
+        name = src_name;
+    }
+    else if(found == 0){
+        fprintf(fs_output(), "cp: '%s' already exists\n", dst_path);
+        goto done;
+    }
+    else{
+        dir = dst_parent;
+        name = dst_name;
+    }
+
+    if(src_entry.is_dir && job.from == job.to && inside(dir, src_entry.start_cluster)){
+        fprintf(fs_output(), "cp: can't copy a directory inside itself\n");
+        goto done;
+    }
+
+    if(!src_entry.is_dir) copy_file(&job, &src_entry, dir, name);
+    else if(!name[0]) copy_tree(&job, src_entry.start_cluster, dir, 0);
+    else{
+        int sub = copy_dir_entry(&job, dir, name);
+        if(sub != -1) copy_tree(&job, src_entry.start_cluster, sub, 0);
+    }
+    fprintf(fs_output(), "cp: %d files and %d directories copied (%ld clusters)\n", job.files, job.dirs, job.clusters);
+
+done:
+    if(job.from != home && job.from != -1){
+        switch_mount(job.from);
+        backend->release(storage);
     }
-    printf("$ ");
-}
\ No newline at end of file
+    switch_mount(home);
+    if(backend && backend->writeback) writeback_start();
+}
+
+typedef struct LayoutFile{
+    char* path;
+    int start_cluster;
+    int size;
+    int clusters;       // the rest is filled in by the workers
+    int fragments;      // runs of consecutive clusters the chain is made of
+    int broken;         // chain leaves the data area or never ends
+} LayoutFile;
+
+typedef struct LayoutDir{
+    char* path;
+    int clusters;
+    int entries;        // live ones, "." and ".." excluded
+} LayoutDir;
+
+// Free space is scanned in slices, runs crossing slice boundaries are glued back together afterwards
+typedef struct FreeSlice{
+    int first;
+    int last;           // one past the last cluster
+    int head;           // free clusters at the start of the slice
+    int tail;           // free clusters at the end of the slice
+    int free;
+    long histogram[32]; // runs fully inside the slice, by log2 of their length
+    int largest;        // among those
+} FreeSlice;
+
+typedef struct Layout{
+    LayoutFile* files;
+    int file_count;
+    LayoutDir* dirs;
+    int dir_count;
+    FreeSlice slices[MAX_THREADS];
+    int slice_count;
+    int next_job;       // files first, then slices, taken with an atomic add
+} Layout;
+
+static void layout_file(LayoutFile* file){
+    file->clusters = file->fragments = file->broken = 0;
+    int previous = -2;
+    for(int c = file->start_cluster; c != FAT_EOC; c = fat[c]){
+        if(c < fs->data_start || c >= fs->total_cluster || file->clusters == fs->total_cluster){
+            file->broken = 1;
+            return;
+        }
+        if(c != previous + 1) file->fragments++;
+        file->clusters++;
+        previous = c;
+    }
+}
+
+static void free_run_found(long* histogram, int* largest, int len){
+    histogram[31 - __builtin_clz(len)]++;
+    if(len > *largest) *largest = len;
+}
+
+static void layout_slice(FreeSlice* slice){
+    memset(slice->histogram, 0, sizeof(slice->histogram));
+    slice->largest = 0;
+    slice->free = 0;
+    for(int c = slice->first; c < slice->last; c++)
+        slice->free += !fat[c];
+
+    int i = slice->first;
+    while(i < slice->last && !fat[i]) i++;
+    slice->head = i - slice->first;
+    if(i == slice->last){
+        slice->tail = slice->head;      // all free, the caller knows
+        return;
+    }
+
+    int run = 0;
+    for(; i < slice->last; i++){
+        if(!fat[i]){
+            run++;
+            continue;
+        }
+        if(run) free_run_found(slice->histogram, &slice->largest, run);
+        run = 0;
+    }
+    slice->tail = run;
+}
+
+// Only reads the FAT, so it doesn't matter which backend holds the clusters
+static void* layout_worker(void* arg){
+    Layout* layout = (Layout*)arg;
+    int i;
+    while((i = __atomic_fetch_add(&layout->next_job, 1, __ATOMIC_RELAXED)) < layout->file_count + layout->slice_count){
+        if(i < layout->file_count) layout_file(&layout->files[i]);
+        else layout_slice(&layout->slices[i - layout->file_count]);
+    }
+    return NULL;
+}
+
+static void layout_add_file(Layout* layout, const char* path, FSEntry* entry){
+    if(layout->file_count % 64 == 0){
+        layout->files = realloc(layout->files, (layout->file_count + 64) * sizeof(LayoutFile));
+        assert(layout->files && "realloc failed");
+    }
+    LayoutFile* file = &layout->files[layout->file_count++];
+    file->path = strdup(path);
+    file->start_cluster = entry->start_cluster;
+    file->size = entry->size;
+}
+
+// Collects every file and directory below <dir_cluster>, <path> is the path of the directory
+static int layout_collect(Layout* layout, int dir_cluster, const char* path, int depth){
+    if(depth >= MAX_DEPTH){
+        fprintf(fs_output(), "layout: %s: too deep\n", path);
+        return -1;
+    }
+
+    if(layout->dir_count % 64 == 0){
+        layout->dirs = realloc(layout->dirs, (layout->dir_count + 64) * sizeof(LayoutDir));
+        assert(layout->dirs && "realloc failed");
+    }
+    int self = layout->dir_count++;
+    layout->dirs[self].path = strdup(*path ? path : ".");
+    layout->dirs[self].clusters = 0;
+    layout->dirs[self].entries = 0;
+
+    int cluster = dir_cluster;
+    while(cluster != FAT_EOC){
+        if(check_cluster(cluster, "layout") == -1) return -1;
+        layout->dirs[self].clusters++;
+        void* cluster_ptr = cluster_at(cluster);
+        FSEntry* entries = (FSEntry*)(cluster_ptr + sizeof(int));
+        int entry_count = *(int*)cluster_ptr;
+
+        for(int i = 0; i < entry_count; i++){
+            if(strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) continue;
+            layout->dirs[self].entries++;
+
+            char child[MAX_DEPTH * FILENAME_LEN];
+            snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", entries[i].name);
+            // layout->dirs may move while we recurse, that's why we hold on to an index
+            if(entries[i].is_dir){
+                if(layout_collect(layout, entries[i].start_cluster, child, depth + 1) == -1) return -1;
+                entries = (FSEntry*)(cluster_at(cluster) + sizeof(int));     // the subtree may have pushed it out of the window
+            }
+            else layout_add_file(layout, child, &entries[i]);
+        }
+        cluster = fat[cluster];
+    }
+    return 0;
+}
+
+// Prints <s> as a JSON string
+static void json_string(FILE* out, const char* s){
+    fputc('"', out);
+    for(; *s; s++){
+        if(*s == '"' || *s == '\\') fputc('\\', out);
+        if((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Reports how fragmented the files below <name> are, how full its directories are and what the free space
+// of the whole image looks like. The FAT walks are spread among threads
+void _layout(const char* name, int json){
+    Layout layout = {0};
+
+    int parent;
+    FSEntry entry;
+    char last[FILENAME_LEN];
+    if(resolve_path(name, &parent, &entry, last, "layout") != 0){
+        if(last[0]) fprintf(fs_output(), "layout: '%s' not found\n", name);
+        return;
+    }
+    if(entry.is_dir){
+        // The directory itself goes by the path it was asked with, what's below it by relative paths
+        if(layout_collect(&layout, entry.start_cluster, "", 0) == -1) goto cleanup;
+        free(layout.dirs[0].path);
+        layout.dirs[0].path = strdup(name);
+    }
+    else layout_add_file(&layout, name, &entry);
+
+    int data_clusters = fs->total_cluster - fs->data_start;
+    int thread_count = worker_count(layout.file_count + data_clusters / 4096 + 1);
+    layout.slice_count = thread_count;
+    int per_slice = (data_clusters + thread_count - 1) / thread_count;
+    for(int t = 0; t < thread_count; t++){
+        layout.slices[t].first = fs->data_start + t * per_slice < fs->total_cluster ? fs->data_start + t * per_slice : fs->total_cluster;
+        layout.slices[t].last = layout.slices[t].first + per_slice < fs->total_cluster ? layout.slices[t].first + per_slice : fs->total_cluster;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    for(int t = 0; t < thread_count; t++)
+        assert(!pthread_create(&threads[t], NULL, layout_worker, &layout) && "pthread_create failed");
+    for(int t = 0; t < thread_count; t++)
+        assert(!pthread_join(threads[t], NULL) && "pthread_join failed");
+
+    // Glue the slices together
+    long histogram[32] = {0};
+    int largest = 0, carry = 0;
+    long free_clusters = 0, extents = 0;
+    for(int t = 0; t < layout.slice_count; t++){
+        FreeSlice* slice = &layout.slices[t];
+        if(slice->head == slice->last - slice->first){
+            carry += slice->head;
+            continue;
+        }
+        if(carry + slice->head) free_run_found(histogram, &largest, carry + slice->head);
+        for(int b = 0; b < 32; b++) histogram[b] += slice->histogram[b];
+        if(slice->largest > largest) largest = slice->largest;
+        carry = slice->tail;
+    }
+    if(carry) free_run_found(histogram, &largest, carry);
+    for(int b = 0; b < 32; b++) extents += histogram[b];
+    for(int t = 0; t < layout.slice_count; t++) free_clusters += layout.slices[t].free;
+
+    int slots_per_cluster = MAX_ENTRIES;
+    long fragments = 0;
+    int fragmented = 0, broken = 0;
+    for(int i = 0; i < layout.file_count; i++){
+        fragments += layout.files[i].fragments;
+        fragmented += layout.files[i].fragments > 1;
+        broken += layout.files[i].broken;
+    }
+
+    FILE* out = fs_output();
+    if(json){
+        fprintf(out, "{\"files\":[");
+        for(int i = 0; i < layout.file_count; i++){
+            LayoutFile* f = &layout.files[i];
+            fprintf(out, "%s{\"path\":", i ? "," : "");
+            json_string(out, f->path);
+            fprintf(out, ",\"size\":%d,\"clusters\":%d,\"fragments\":%d,\"avg_run\":%.2f,\"broken\":%s}", f->size, f->clusters,
+                    f->fragments, f->fragments ? (double)f->clusters / f->fragments : 0.0, f->broken ? "true" : "false");
+        }
+        fprintf(out, "],\"directories\":[");
+        for(int i = 0; i < layout.dir_count; i++){
+            LayoutDir* d = &layout.dirs[i];
+            fprintf(out, "%s{\"path\":", i ? "," : "");
+            json_string(out, d->path);
+            fprintf(out, ",\"clusters\":%d,\"entries\":%d,\"slots\":%d}", d->clusters, d->entries, d->clusters * slots_per_cluster);
+        }
+        fprintf(out, "],\"free\":{\"clusters\":%ld,\"extents\":%ld,\"largest_run\":%d,\"histogram\":[", free_clusters, extents, largest);
+        int first = 1;
+        for(int b = 0; b < 32; b++){
+            if(!histogram[b]) continue;
+            fprintf(out, "%s{\"min\":%ld,\"max\":%ld,\"count\":%ld}", first ? "" : ",", 1L << b, (2L << b) - 1, histogram[b]);
+            first = 0;
+        }
+        fprintf(out, "]}}\n");
+        goto cleanup;
+    }
+
+    if(layout.file_count){
+        fprintf(out, "%-40s %10s %10s %10s %10s\n", "file", "size", "clusters", "fragments", "avg run");
+        for(int i = 0; i < layout.file_count; i++){
+            LayoutFile* f = &layout.files[i];
+            fprintf(out, "%-40s %10d %10d %10d %10.1f%s\n", f->path, f->size, f->clusters, f->fragments,
+                    f->fragments ? (double)f->clusters / f->fragments : 0.0, f->broken ? "  broken chain" : "");
+        }
+        fprintf(out, "\n");
+    }
+    if(layout.dir_count){
+        fprintf(out, "%-40s %10s %10s %10s\n", "directory", "clusters", "entries", "slots used");
+        for(int i = 0; i < layout.dir_count; i++){
+            LayoutDir* d = &layout.dirs[i];
+            fprintf(out, "%-40s %10d %10d %9.0f%%\n", d->path, d->clusters, d->entries,
+                    100.0 * d->entries / (d->clusters * slots_per_cluster));
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "free space: %ld clusters (%ld KB) in %ld extents, largest run %d clusters (%ld KB)\n",
+            free_clusters, free_clusters * CLUSTER_SIZE / 1024, extents, largest, (long)largest * CLUSTER_SIZE / 1024);
+    for(int b = 0; b < 32; b++)
+        if(histogram[b]) fprintf(out, "  %10ld - %-10ld clusters %10ld extents\n", 1L << b, (2L << b) - 1, histogram[b]);
+    fprintf(out, "layout: %d files (%d fragmented, %d broken), %.2f fragments per file, %d directories\n",
+            layout.file_count, fragmented, broken, layout.file_count ? (double)fragments / layout.file_count : 0.0, layout.dir_count);
+
+cleanup:
+    for(int i = 0; i < layout.file_count; i++) free(layout.files[i].path);
+    for(int i = 0; i < layout.dir_count; i++) free(layout.dirs[i].path);
+    free(layout.files);
+    free(layout.dirs);
+}
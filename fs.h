@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#include "backend.h"
 
 #define FILENAME_LEN 32
 #define CLUSTER_SIZE 512
@@ -20,12 +23,30 @@ typedef struct FileSystem{
     int root_cluster;
     int fat_start;
     int data_start;
+    int crc_start;  // first cluster of the checksum table, 0 if checksums are disabled
 } FileSystem;
 
+// Command output of the calling thread goes to fs_out (stdout if NULL), see fs_output()
+extern __thread FILE* fs_out;
+extern __thread int current_cluster;
+
 // FS functions
-void format(const char* fs_filename, int size);
-int open_fs(const char* fs_filename);
+void format(const char* fs_filename, int size, int checksums);
+int open_fs(const char* fs_filename, const Backend* with, const BackendOptions* options);
 void close_fs();
+int mount_fs(const char* name, const char* fs_filename, const Backend* with, const BackendOptions* options);
+int use_fs(const char* name);
+int unmount_fs(const char* name);
+void unmount_all();
+const char* mounted_image();
+int concurrent_readers();
+void list_mounts();
+void _cp(const char* src, const char* dst);
+void _layout(const char* name, int json);
+void grow_fs(int new_size);
+void export_image(const char* out_filename);
+void import_image(const char* in_filename, const char* fs_filename);
+void sync_image(const char* src_filename, const char* dst_filename, int force);
 void _mkdir(const char* name);
 void _rm(const char* name);
 void _cd(const char* name);
@@ -40,3 +61,15 @@ void free_cluster_chain(int cluster);
 void read_file(int start_cluster, int size);
 void write_file(int start_cluster, int size, const char* text);
 void print_path();
+void reset_current_dir();
+int directory_exists(int cluster);
+FILE* fs_output();
+void set_fat(int cluster, int value);
+void cluster_changed(int cluster);
+int verify_cluster(int cluster);
+int check_cluster(int cluster, const char* cmd);
+void scrub();
+void fs_release();
+void writeback_set(int ms, int kb);
+void sync_fs();
+void _grep(const char* pattern, const char* name, int recursive);
@@ -1,184 +1,878 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "fs.h"
 
 #define MAX_LINE 1024
+#define MAX_TRACED_COMMANDS 32
+#define MAX_OPTIONS 8
+#define SERVER_THREADS 16      // clients served at the same time, the others wait in the listen queue
+#define SERVER_BACKLOG 64
 
-// Used to make sure user can't open or format a FS while another FS is already open 
+// Set while at least one FS is mounted, format and the image commands need none; filename is the active one
 int fs_open = 0;
 char filename[FILENAME_LEN] = "";
 
+// Command trace being recorded, NULL if tracing is off
+FILE* trace_file = NULL;
+struct timespec trace_start;
+
+// Latencies collected during a replay, one set per command name
+typedef struct CommandStats {
+    char name[16];
+    double* samples;    // microseconds
+    int count;
+    int capacity;
+} CommandStats;
+
+// Server mode: commands that only read the image share this lock, the others take it exclusively
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+int server_fd = -1;
+int* session_cwd[SERVER_THREADS];   // working directory of the client served by each thread, NULL if idle
+
+int run_command(char* line);
+
 // Print help menù
 void print_help() {
-    printf("Available commands:\n");
-    printf("\t- format <file_system> <size>\n");
-    printf("\t- open   <file_system>\n");
-    printf("\t- mkdir  <dir>\n");
-    printf("\t- cd     <dir | / | .. | .>\n");
-    printf("\t- touch  <file>\n");
-    printf("\t- cat    <file>\n");
-    printf("\t- ls     <dir>\n");
-    printf("\t- append <file> <text>\n");
-    printf("\t- rm     <dir/file>\n");
-    printf("\t- close\n");
-    printf("\t- clear\n");
-    printf("\t- help\n");
-    printf("\t- quit\n");
+    fprintf(fs_output(), "Available commands:\n");
+    fprintf(fs_output(), "\t- format <file_system> <size> [--crc]\n");
+    fprintf(fs_output(), "\t- open   <file_system> [as <name>] [--backend <mmap | pread | memory>] [--window <MB>] [--cache <MB>] [--direct]\n");
+    fprintf(fs_output(), "\t- grow   <size>\n");
+    fprintf(fs_output(), "\t- export-image <out>\n");
+    fprintf(fs_output(), "\t- import-image <in> <file_system>\n");
+    fprintf(fs_output(), "\t- sync-image   <src> <dst> [--force]\n");
+    fprintf(fs_output(), "\t- mkdir  <dir>\n");
+    fprintf(fs_output(), "\t- cd     <dir | / | .. | .>\n");
+    fprintf(fs_output(), "\t- touch  <file>\n");
+    fprintf(fs_output(), "\t- cat    <file>\n");
+    fprintf(fs_output(), "\t- ls     <dir>\n");
+    fprintf(fs_output(), "\t- append <file> <text>\n");
+    fprintf(fs_output(), "\t- rm     <dir/file>\n");
+    fprintf(fs_output(), "\t- grep   [-r] <pattern> <file/dir>\n");
+    fprintf(fs_output(), "\t- layout [<path>] [--json]\n");
+    fprintf(fs_output(), "\t- scrub\n");
+    fprintf(fs_output(), "\t- sync\n");
+    fprintf(fs_output(), "\t- writeback [<ms> [<KB>]]\n");
+    fprintf(fs_output(), "\t- use    <name>\n");
+    fprintf(fs_output(), "\t- mounts\n");
+    fprintf(fs_output(), "\t- cp     <[name:]src> <[name:]dst>\n");
+    fprintf(fs_output(), "\t- close  [<name>]\n");
+    fprintf(fs_output(), "\t- trace  <on <file> | off>\n");
+    fprintf(fs_output(), "\t- clear\n");
+    fprintf(fs_output(), "\t- help\n");
+    fprintf(fs_output(), "\t- quit\n");
+}
+
+// Default mount name: the image file name without directories and extension
+void default_mount_name(const char* file, char* name) {
+    const char* base = strrchr(file, '/');
+    snprintf(name, FILENAME_LEN, "%s", base ? base + 1 : file);
+    char* dot = strrchr(name, '.');
+    if (dot && dot != name) *dot = '\0';
+}
+
+// Open state and prompt follow the active mount
+void follow_active_mount() {
+    const char* image = mounted_image();
+    fs_open = image != NULL;
+    strncpy(filename, image ? image : "", FILENAME_LEN);
+    filename[FILENAME_LEN - 1] = '\0';
 }
 
 // Check if we got the right number of token for a specific function
 int check_arity(const char* cmd, int got, int expected) {
     if (got != expected) {
-        printf("%s: wrong number of arguments (expected %d, actual %d)\n",
+        fprintf(fs_output(), "%s: wrong number of arguments (expected %d, actual %d)\n",
                cmd, expected - 1, got - 1);
         return -1;
     }
     return 0;
 }
 
-// Shell loop
-int main(void) {
-    char line[MAX_LINE];
+// Parses the options of open (and replay) from <args>, complaining on behalf of <cmd> if something's wrong
+int parse_open_options(const char* cmd, char** args, int count, const Backend** backend, BackendOptions* options) {
+    *backend = &mmap_backend;
+    memset(options, 0, sizeof(*options));
 
-    printf("Mini‑shell FAT – type 'help' to list commands, 'quit' to shutdown.\n");
+    for (int i = 0; i < count; i++) {
+        if (strcmp(args[i], "--direct") == 0) {
+            options->direct = 1;
+            continue;
+        }
+        if (i + 1 == count) {
+            fprintf(fs_output(), "%s: unknown or incomplete option '%s'\n", cmd, args[i]);
+            return -1;
+        }
+        if (strcmp(args[i], "--backend") == 0) {
+            *backend = find_backend(args[++i]);
+            if (!*backend) { fprintf(fs_output(), "%s: unknown backend '%s'\n", cmd, args[i]); return -1; }
+        }
+        else if (strcmp(args[i], "--window") == 0 || strcmp(args[i], "--cache") == 0) {
+            int mb = atoi(args[i + 1]);
+            if (mb <= 0) { fprintf(fs_output(), "%s: %s wants a positive number of MB\n", cmd, args[i]); return -1; }
+            if (strcmp(args[i], "--window") == 0) options->window_mb = mb;
+            else options->cache_mb = mb;
+            i++;
+        }
+        else {
+            fprintf(fs_output(), "%s: unknown option '%s'\n", cmd, args[i]);
+            return -1;
+        }
+    }
 
-    while (1) {
-        if(!fs_open) printf("fs> ");
-        else{
-            printf("fs@%s:",filename);
+    if (options->window_mb && *backend != &mmap_backend) { fprintf(fs_output(), "%s: --window only works with the mmap backend\n", cmd); return -1; }
+    if ((options->cache_mb || options->direct) && *backend != &pread_backend) { fprintf(fs_output(), "%s: --cache and --direct only work with the pread backend\n", cmd); return -1; }
+    return 0;
+}
+
+// Microseconds elapsed since <start>
+double elapsed_us(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Appends <line> to the trace as <microseconds since trace on>\t<line>
+void trace_record(const char* line) {
+    // trace commands themselves are not part of the workload
+    if (strncmp(line, "trace", 5) == 0 && (line[5] == ' ' || line[5] == '\0')) return;
+    fprintf(trace_file, "%ld\t%s\n", (long)elapsed_us(&trace_start), line);
+    fflush(trace_file);
+}
+
+void add_sample(CommandStats* stats, int* stats_count, const char* name, double us) {
+    CommandStats* entry = NULL;
+    for (int i = 0; i < *stats_count && !entry; i++)
+        if (strcmp(stats[i].name, name) == 0) entry = &stats[i];
+
+    if (!entry) {
+        if (*stats_count == MAX_TRACED_COMMANDS) return;
+        entry = &stats[(*stats_count)++];
+        strncpy(entry->name, name, sizeof(entry->name));
+        entry->name[sizeof(entry->name) - 1] = '\0';
+        entry->samples = NULL;
+        entry->count = entry->capacity = 0;
+    }
+
+    if (entry->count == entry->capacity) {
+        entry->capacity = entry->capacity ? entry->capacity * 2 : 64;
+        entry->samples = realloc(entry->samples, entry->capacity * sizeof(double));
+        if (!entry->samples) { perror("realloc"); exit(1); }
+    }
+    entry->samples[entry->count++] = us;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Commands replay may run: they only work inside the image it was given. Anything else (switching images,
+// writing other files, resizing the image...) is skipped, including commands added later until they're listed here
+int replayable(const char* name) {
+    const char* allowed[] = { "help", "mkdir", "cd", "touch", "cat", "ls", "rm", "append", "cp", "grep", "layout", "scrub",
+                              "sync", "writeback", "mounts" };
+    for (int i = 0; i < (int)(sizeof(allowed) / sizeof(allowed[0])); i++)
+        if (strcmp(name, allowed[i]) == 0) return 1;
+    return 0;
+}
+
+// Line of <trace> from which commands would run on another image than the first one opened (a second open, a use,
+// anything after a close), 0 if the whole trace works on a single image. The trace is rewound
+int trace_other_image(FILE* trace) {
+    char line[MAX_LINE + 32];
+    int number = 0, opened = 0, closed = 0;
+    while (fgets(line, sizeof(line), trace)) {
+        number++;
+        char* tab = strchr(line, '\t');
+        char name[16];
+        if (!tab || sscanf(tab + 1, "%15s", name) != 1) continue;
+        int open = strcmp(name, "open") == 0;
+        if (strcmp(name, "use") == 0 || (open && opened) || (closed && replayable(name))) {
+            rewind(trace);
+            return number;
+        }
+        if (open) opened = 1;
+        if (strcmp(name, "close") == 0) closed = 1;
+    }
+    rewind(trace);
+    return 0;
+}
+
+// Runs the commands recorded in <trace_path> against <image>, as fast as possible or
+// respecting the recorded timing if <paced> is set, and prints latency statistics
+int replay(const char* trace_path, const char* image, int paced, const Backend* backend, const BackendOptions* options) {
+    FILE* trace = fopen(trace_path, "r");
+    if (!trace) {
+        printf("replay: can't open trace '%s'\n", trace_path);
+        return 1;
+    }
+    // Commands meant for another mount would land on <image>, in the wrong place and with meaningless latencies
+    int other = trace_other_image(trace);
+    if (other) {
+        printf("replay: '%s' works on more than one image from line %d on, it can't be replayed on a single one\n", trace_path, other);
+        fclose(trace);
+        return 1;
+    }
+    if (open_fs(image, backend, options) != 0) {
+        printf("replay: can't open file system '%s'\n", image);
+        fclose(trace);
+        return 1;
+    }
+    fs_open = 1;
+
+    CommandStats stats[MAX_TRACED_COMMANDS];
+    int stats_count = 0;
+    int total = 0, skipped = 0;
+
+    // Commands print their results, we don't want them mixed with the report
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    char line[MAX_LINE + 32];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (fgets(line, sizeof(line), trace)) {
+        line[strcspn(line, "\n")] = 0;
+        char* tab = strchr(line, '\t');
+        if (!tab) continue;
+        long at = atol(line);
+        char* command = tab + 1;
+
+        char name[16];
+        if (sscanf(command, "%15s", name) != 1) continue;
+
+        if (!replayable(name)) {
+            skipped++;
+            continue;
+        }
+
+        if (paced) {
+            long wait = at - (long)elapsed_us(&start);
+            if (wait > 0) usleep(wait);
+        }
+
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        run_command(command);
+        fs_release();
+        add_sample(stats, &stats_count, name, elapsed_us(&t0));
+        total++;
+    }
+    double seconds = elapsed_us(&start) / 1e6;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    fclose(trace);
+    close_fs();
+    fs_open = 0;
+
+    printf("replay: %d commands in %.3f s (%.0f commands/s) on the %s backend, %d skipped\n",
+           total, seconds, seconds > 0 ? total / seconds : 0.0, backend->name, skipped);
+    printf("%-14s %8s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (int i = 0; i < stats_count; i++) {
+        CommandStats* st = &stats[i];
+        qsort(st->samples, st->count, sizeof(double), compare_double);
+        printf("%-14s %8d %10.1f %10.1f %10.1f %10.1f\n", st->name, st->count,
+               st->samples[(int)(0.50 * (st->count - 1))], st->samples[(int)(0.90 * (st->count - 1))],
+               st->samples[(int)(0.99 * (st->count - 1))], st->samples[st->count - 1]);
+        free(st->samples);
+    }
+    return 0;
+}
+
+// Client/server protocol on the Unix socket: every message is a frame made of a 4 byte length
+// (host order, both ends are on the same machine) followed by the payload.
+// The client sends one command line per frame, the server answers with the output of the command
+// followed by the next prompt. An empty answer closes the session.
+
+// Sends or receives exactly <len> bytes, returns -1 if the other end went away
+int transfer_all(int fd, char* buf, size_t len, int sending) {
+    while (len > 0) {
+        ssize_t n = sending ? send(fd, buf, len, MSG_NOSIGNAL) : recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_frame(int fd, const char* payload, uint32_t len) {
+    if (transfer_all(fd, (char*)&len, sizeof(len), 1) == -1) return -1;
+    return transfer_all(fd, (char*)payload, len, 1);
+}
+
+// Receives a frame of at most <max> bytes and NUL terminates it, the caller frees it.
+// Returns NULL if the other end went away or sent something too big
+char* recv_frame(int fd, uint32_t max, uint32_t* len) {
+    if (transfer_all(fd, (char*)len, sizeof(*len), 0) == -1 || *len > max) return NULL;
+    char* payload = malloc(*len + 1);
+    assert(payload && "malloc failed");
+    if (transfer_all(fd, payload, *len, 0) == -1) {
+        free(payload);
+        return NULL;
+    }
+    payload[*len] = '\0';
+    return payload;
+}
+
+// Commands that would switch, leave or rewrite the shared image under the feet of the other clients
+int server_forbidden(const char* name) {
+    const char* forbidden[] = { "open", "close", "use", "format", "import-image", "sync-image", "trace", "clear" };
+    for (int i = 0; i < (int)(sizeof(forbidden) / sizeof(forbidden[0])); i++)
+        if (strcmp(name, forbidden[i]) == 0) return 1;
+    return 0;
+}
+
+// Commands that don't modify the image (cd only moves the working directory of its own client)
+int server_read_only(const char* name) {
+    const char* readers[] = { "help", "ls", "cat", "cd", "grep", "scrub", "export-image", "mounts", "layout" };
+    for (int i = 0; i < (int)(sizeof(readers) / sizeof(readers[0])); i++)
+        if (strcmp(name, readers[i]) == 0) return 1;
+    return 0;
+}
+
+// Runs <line> for the client of the calling thread, returns 1 if the client wants to leave
+int serve_command(char* line) {
+    char name[16];
+    if (sscanf(line, "%15s", name) != 1) return 0;
+    if (strcmp(name, "quit") == 0) return 1;
+    if (server_forbidden(name)) {
+        fprintf(fs_output(), "%s: not available on a shared file system\n", name);
+        return 0;
+    }
+
+    // pread recycles cache buffers other readers may still be looking at, there even readers go one at a time
+    int read_only = server_read_only(name) && concurrent_readers();
+    if (read_only) pthread_rwlock_rdlock(&fs_lock);
+    else pthread_rwlock_wrlock(&fs_lock);
+
+    // Another client removed our working directory, or grow moved it
+    if (!directory_exists(current_cluster)) {
+        fprintf(fs_output(), "%s: working directory no longer exists, back to ~\n", name);
+        reset_current_dir();
+    }
+    run_command(line);
+    if (!read_only) {
+        fs_release();
+        // Directories gone now are marked right away, a new one may reuse their cluster before their clients notice
+        for (int i = 0; i < SERVER_THREADS; i++)
+            if (session_cwd[i] && !directory_exists(*session_cwd[i])) *session_cwd[i] = -1;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
+
+// Talks to one client until it quits or goes away. Output of every command is collected in memory and
+// sent back in a single frame together with the next prompt
+void serve_client(int fd, int slot) {
+    pthread_rwlock_wrlock(&fs_lock);
+    reset_current_dir();      // every client starts from root
+    session_cwd[slot] = &current_cluster;
+    pthread_rwlock_unlock(&fs_lock);
+
+    int first = 1, quit = 0;
+    while (!quit) {
+        char* answer = NULL;
+        size_t answer_len = 0;
+        fs_out = open_memstream(&answer, &answer_len);
+        assert(fs_out && "open_memstream failed");
+
+        if (first) {
+            fprintf(fs_out, "Mini‑shell FAT server on '%s' – type 'help' to list commands, 'quit' to leave.\n", filename);
+            first = 0;
+        }
+        else {
+            uint32_t len;
+            char* line = recv_frame(fd, MAX_LINE - 1, &len);
+            if (!line) quit = 1;    // gone without saying goodbye
+            else {
+                quit = serve_command(line);
+                free(line);
+            }
+        }
+
+        if (!quit) {
+            fprintf(fs_out, "fs@%s:", filename);
+            pthread_rwlock_rdlock(&fs_lock);
+            if (!directory_exists(current_cluster)) reset_current_dir();
             print_path();
+            pthread_rwlock_unlock(&fs_lock);
+        }
+        fclose(fs_out);
+        fs_out = NULL;
+
+        int sent = send_frame(fd, answer, quit ? 0 : answer_len);
+        free(answer);
+        if (sent == -1) break;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    session_cwd[slot] = NULL;
+    pthread_rwlock_unlock(&fs_lock);
+    close(fd);
+}
+
+// Server threads take turns on accept(), each one serves a whole session. <arg> is the slot of the thread
+void* server_worker(void* arg) {
+    int slot = (int)(long)arg;
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
         }
+        serve_client(fd, slot);
+    }
+    return NULL;
+}
+
+// Keeps <image> open and serves clients on <socket_path> until SIGINT or SIGTERM
+int serve(const char* image, const char* socket_path, const Backend* backend, const BackendOptions* options) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("serve: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int result = open_fs(image, backend, options);
+    if (result != 0) {
+        printf("serve: can't open file system '%s'\n", image);
+        return 1;
+    }
+    fs_open = 1;
+    strncpy(filename, image, FILENAME_LEN);
+    filename[FILENAME_LEN - 1] = '\0';
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(server_fd >= 0 && "socket failed");
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        printf("serve: can't bind '%s' (%s)\n", socket_path, strerror(errno));
+        close(server_fd);
+        close_fs();
+        return 1;
+    }
+    assert(!listen(server_fd, SERVER_BACKLOG) && "listen failed");
+
+    // Workers inherit the mask, so the signals can only reach us in sigwait
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+    for (int i = 0; i < SERVER_THREADS; i++) {
+        pthread_t thread;
+        assert(!pthread_create(&thread, NULL, server_worker, (void*)(long)i) && "pthread_create failed");
+        pthread_detach(thread);
+    }
+    printf("serve: '%s' on %s with the %s backend, %d clients at a time\n", image, socket_path, backend->name, SERVER_THREADS);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&stop, &sig);
+
+    // Once we own the lock no command is halfway through, clients still connected are just dropped
+    pthread_rwlock_wrlock(&fs_lock);
+    close(server_fd);
+    unlink(socket_path);
+    close_fs();
+    fs_open = 0;
+    printf("serve: shut down\n");
+    return 0;
+}
+
+// Thin client: reads command lines just like the shell and lets the server run them
+int client(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0 && "socket failed");
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        printf("connect: no server on '%s'\n", socket_path);
+        close(fd);
+        return 1;
+    }
+
+    char line[MAX_LINE];
+    while (1) {
+        uint32_t len;
+        char* answer = recv_frame(fd, UINT32_MAX - 1, &len);
+        if (!answer) {
+            printf("connect: server went away\n");
+            break;
+        }
+        fwrite(answer, 1, len, stdout);
+        fflush(stdout);
+        free(answer);
+        if (len == 0) break;       // session closed
 
         if (!fgets(line, sizeof(line), stdin)) {        // EOF (Ctrl‑D)
             putchar('\n');
-            break;
+            strcpy(line, "quit");
         }
-        // Removes final newline
         line[strcspn(line, "\n")] = 0;
+        if (send_frame(fd, line, strlen(line)) == -1) {
+            printf("connect: server went away\n");
+            break;
+        }
+    }
 
-        // Ignores empty lines or lines just made of spaces
-        if (strspn(line, " \t") == strlen(line)) continue;
+    close(fd);
+    printf("Bye!\n");
+    return 0;
+}
 
-        // 1st token = command
-        char* cmd = strtok(line, " ");
-        if (!cmd) continue;
+// Runs a single command line, returns 1 if the shell has to quit
+int run_command(char* line) {
+    // 1st token = command (strtok_r, the server runs commands from several threads)
+    char* save;
+    char* cmd = strtok_r(line, " ", &save);
+    if (!cmd) return 0;
 
-        // Quit and help are always available
-        if (strcmp(cmd, "quit") == 0) {
-            break;
-        } else if (strcmp(cmd, "help") == 0) {
-            print_help();
-        }else if(strcmp(cmd, "clear") == 0) {
-            system("clear");
+    // Quit and help are always available
+    if (strcmp(cmd, "quit") == 0) {
+        return 1;
+    } else if (strcmp(cmd, "help") == 0) {
+        print_help();
+    }else if(strcmp(cmd, "clear") == 0) {
+        system("clear");
+    }
+
+    // Trace
+    else if (strcmp(cmd, "trace") == 0) {
+        char* a = strtok_r(NULL, " ", &save);
+        char* b = strtok_r(NULL, " ", &save);
+        if (a && strcmp(a, "on") == 0) {
+            if (check_arity("trace", b ? 3 : 2, 3) == -1) return 0;
+            if (trace_file) { fprintf(fs_output(), "trace: already recording\n"); return 0; }
+            trace_file = fopen(b, "w");
+            if (!trace_file) { fprintf(fs_output(), "trace: can't create '%s'\n", b); return 0; }
+            clock_gettime(CLOCK_MONOTONIC, &trace_start);
         }
+        else if (a && strcmp(a, "off") == 0) {
+            if (check_arity("trace", b ? 3 : 2, 2) == -1) return 0;
+            if (!trace_file) { fprintf(fs_output(), "trace: not recording\n"); return 0; }
+            fclose(trace_file);
+            trace_file = NULL;
+        }
+        else fprintf(fs_output(), "trace: usage is trace <on <file> | off>\n");
+    }
 
-        // Format
-        else if (strcmp(cmd, "format") == 0) {
-            if (fs_open) {
-                printf("format: another file system is already open\n");
-                continue;
-            }
-            char* a = strtok(NULL, " ");
-            char* b = strtok(NULL, " ");
-            if (check_arity("format", a && b ? 3 : (a ? 2 : 1), 3) == -1) continue;
-            int size = atoi(b);
-            if (size <= 0) { printf("format: <size> must be a positive integer\n"); continue; }
-            format(a, size);
-        }
-
-        // Open
-        else if (strcmp(cmd, "open") == 0) {
-            if (fs_open) { 
-                printf("open: a file system is already open\n"); 
-                continue; 
-            }
-            char* file = strtok(NULL, " ");
-            if (check_arity("open", file ? 2 : 1, 2) == -1) continue;
-            if(open_fs(file) == -1){
-                fs_open = 0;
-                printf("open: file system does not exist\n");
-                continue;
-            }
-            fs_open = 1;
-            strncpy(filename, file, FILENAME_LEN);
-            filename[FILENAME_LEN - 1] = '\0';
+    // Format
+    else if (strcmp(cmd, "format") == 0) {
+        if (fs_open) {
+            fprintf(fs_output(), "format: another file system is already open\n");
+            return 0;
         }
+        char* a = strtok_r(NULL, " ", &save);
+        char* b = strtok_r(NULL, " ", &save);
+        char* c = strtok_r(NULL, " ", &save);    // optional --crc
+        if (c && strcmp(c, "--crc") != 0) { fprintf(fs_output(), "format: unknown option '%s'\n", c); return 0; }
+        if (check_arity("format", a && b ? 3 : (a ? 2 : 1), 3) == -1) return 0;
+        int size = atoi(b);
+        if (size <= 0) { fprintf(fs_output(), "format: <size> must be a positive integer\n"); return 0; }
+        format(a, size, c != NULL);
+    }
 
-        // Close
-        else if (strcmp(cmd, "close") == 0) {
-            if (!fs_open) { 
-                printf("close: no file system is currently open\n"); 
-                continue; 
-            }
-            if (check_arity("close", 1, 1) == -1) continue;     // 1=1 is always true, we want to skip the arity check
-            close_fs();
-            fs_open = 0;
-            filename[0] = '\0';     // very bad way to empty filename array once the FS is close
+    // Import and sync work on image files, not on the open FS
+    else if (strcmp(cmd, "import-image") == 0 || strcmp(cmd, "sync-image") == 0) {
+        if (fs_open) {
+            fprintf(fs_output(), "%s: close the open file system first\n", cmd);
+            return 0;
         }
+        char* a = strtok_r(NULL, " ", &save);
+        char* b = strtok_r(NULL, " ", &save);
+        char* c = strtok_r(NULL, " ", &save);    // optional --force (sync-image only)
+        if (c && (strcmp(cmd, "sync-image") != 0 || strcmp(c, "--force") != 0)) {
+            fprintf(fs_output(), "%s: unknown option '%s'\n", cmd, c);
+            return 0;
+        }
+        if (check_arity(cmd, a && b ? 3 : (a ? 2 : 1), 3) == -1) return 0;
+        if (strcmp(cmd, "import-image") == 0) import_image(a, b);
+        else sync_image(a, b, c != NULL);
+    }
 
-        // Command listed in the else below require an open file_system
-        else {
+    // Open: every image is mounted under a name, the last one opened becomes the active one
+    else if (strcmp(cmd, "open") == 0) {
+        char* file = strtok_r(NULL, " ", &save);
+        if (check_arity("open", file ? 2 : 1, 2) == -1) return 0;
 
-            if (!fs_open) {
-                printf("You must first open a file system with command 'open'.\n");
-                continue;
-            }
+        char* args[MAX_OPTIONS];
+        int count = 0;
+        while (count < MAX_OPTIONS && (args[count] = strtok_r(NULL, " ", &save))) count++;
 
-            // mkdir
-            if (strcmp(cmd, "mkdir") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("mkdir", n ? 2 : 1, 2) == -1) continue;
-                _mkdir(n);
-            }
-            // cd
-            else if (strcmp(cmd, "cd") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("cd", n ? 2 : 1, 2) == -1) continue;
-                _cd(n);
+        char name[FILENAME_LEN];
+        char** options_start = args;
+        if (count > 0 && strcmp(args[0], "as") == 0) {
+            if (count < 2) { fprintf(fs_output(), "open: 'as' wants a name\n"); return 0; }
+            if (strlen(args[1]) >= FILENAME_LEN || strpbrk(args[1], ":/")) {
+                fprintf(fs_output(), "open: invalid mount name '%s'\n", args[1]);
+                return 0;
             }
-            // touch
-            else if (strcmp(cmd, "touch") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("touch", n ? 2 : 1, 2) == -1) continue;
-                _touch(n);
-            }
-            // cat
-            else if (strcmp(cmd, "cat") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("cat", n ? 2 : 1, 2) == -1) continue;
-                _cat(n);
-            }
-            // ls
-            else if (strcmp(cmd, "ls") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("ls", n ? 2 : 1, 2) == -1) continue;
-                _ls(n);
-            }
-            // rm
-            else if (strcmp(cmd, "rm") == 0) {
-                char* n = strtok(NULL, " ");
-                if (check_arity("rm", n ? 2 : 1, 2) == -1) continue;
-                _rm(n);
-            }
-            // append
-            else if (strcmp(cmd, "append") == 0) {
-                char* file = strtok(NULL, " ");
-                char* text = strtok(NULL, "");      // whatever is left is text
-                int provided = file ? (text ? 3 : 2) : 1;
-                if (check_arity("append", provided, 3) == -1) continue;
-                _append(file, text);
+            strcpy(name, args[1]);
+            options_start += 2;
+            count -= 2;
+        }
+        else default_mount_name(file, name);
+
+        const Backend* backend;
+        BackendOptions options;
+        if (parse_open_options("open", options_start, count, &backend, &options) == -1) return 0;
+
+        int result = mount_fs(name, file, backend, &options);
+        if(result == -1)
+            fprintf(fs_output(), "open: file system does not exist\n");
+        else if(result == -2)
+            fprintf(fs_output(), "open: the %s backend can't load '%s'\n", backend->name, file);
+        else if(result == -3)
+            fprintf(fs_output(), "open: '%s' or '%s' is already mounted (use 'open <file_system> as <name>')\n", file, name);
+        else if(result == -4)
+            fprintf(fs_output(), "open: too many file systems open\n");
+        follow_active_mount();
+    }
+
+    // Close
+    else if (strcmp(cmd, "close") == 0) {
+        if (!fs_open) { 
+            fprintf(fs_output(), "close: no file system is currently open\n"); 
+            return 0; 
+        }
+        char* name = strtok_r(NULL, " ", &save);      // optional, the active one by default
+        if (unmount_fs(name) == -1) fprintf(fs_output(), "close: no file system mounted as '%s'\n", name);
+        follow_active_mount();
+    }
+
+    // Command listed in the else below require an open file_system
+    else {
+
+        if (!fs_open) {
+            fprintf(fs_output(), "You must first open a file system with command 'open'.\n");
+            return 0;
+        }
+
+        // use
+        if (strcmp(cmd, "use") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("use", n ? 2 : 1, 2) == -1) return 0;
+            if (use_fs(n) == -1) fprintf(fs_output(), "use: no file system mounted as '%s'\n", n);
+            follow_active_mount();
+        }
+        // mounts
+        else if (strcmp(cmd, "mounts") == 0) {
+            if (check_arity("mounts", strtok_r(NULL, " ", &save) ? 2 : 1, 1) == -1) return 0;
+            list_mounts();
+        }
+        // cp
+        else if (strcmp(cmd, "cp") == 0) {
+            char* a = strtok_r(NULL, " ", &save);
+            char* b = strtok_r(NULL, " ", &save);
+            char* extra = strtok_r(NULL, " ", &save);
+            if (check_arity("cp", extra ? 4 : (a && b ? 3 : (a ? 2 : 1)), 3) == -1) return 0;
+            _cp(a, b);
+        }
+        // grow
+        else if (strcmp(cmd, "grow") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("grow", n ? 2 : 1, 2) == -1) return 0;
+            int size = atoi(n);
+            if (size <= 0) { fprintf(fs_output(), "grow: <size> must be a positive integer\n"); return 0; }
+            grow_fs(size);
+        }
+        // export-image
+        else if (strcmp(cmd, "export-image") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("export-image", n ? 2 : 1, 2) == -1) return 0;
+            export_image(n);
+        }
+        // mkdir
+        else if (strcmp(cmd, "mkdir") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("mkdir", n ? 2 : 1, 2) == -1) return 0;
+            _mkdir(n);
+        }
+        // cd
+        else if (strcmp(cmd, "cd") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("cd", n ? 2 : 1, 2) == -1) return 0;
+            _cd(n);
+        }
+        // touch
+        else if (strcmp(cmd, "touch") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("touch", n ? 2 : 1, 2) == -1) return 0;
+            _touch(n);
+        }
+        // cat
+        else if (strcmp(cmd, "cat") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("cat", n ? 2 : 1, 2) == -1) return 0;
+            _cat(n);
+        }
+        // ls
+        else if (strcmp(cmd, "ls") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("ls", n ? 2 : 1, 2) == -1) return 0;
+            _ls(n);
+        }
+        // rm
+        else if (strcmp(cmd, "rm") == 0) {
+            char* n = strtok_r(NULL, " ", &save);
+            if (check_arity("rm", n ? 2 : 1, 2) == -1) return 0;
+            _rm(n);
+        }
+        // append
+        else if (strcmp(cmd, "append") == 0) {
+            char* file = strtok_r(NULL, " ", &save);
+            char* text = strtok_r(NULL, "", &save);      // whatever is left is text
+            int provided = file ? (text ? 3 : 2) : 1;
+            if (check_arity("append", provided, 3) == -1) return 0;
+            _append(file, text);
+        }
+        // grep
+        else if (strcmp(cmd, "grep") == 0) {
+            char* a = strtok_r(NULL, " ", &save);
+            int recursive = a && strcmp(a, "-r") == 0;
+            if (recursive) a = strtok_r(NULL, " ", &save);
+            char* b = strtok_r(NULL, " ", &save);
+            char* extra = strtok_r(NULL, " ", &save);
+            if (check_arity("grep", extra ? 4 : (a && b ? 3 : (a ? 2 : 1)), 3) == -1) return 0;
+            _grep(a, b, recursive);
+        }
+        // layout
+        else if (strcmp(cmd, "layout") == 0) {
+            char* a = strtok_r(NULL, " ", &save);
+            char* b = strtok_r(NULL, " ", &save);
+            char* extra = strtok_r(NULL, " ", &save);
+            int json = 0;
+            if (b && strcmp(b, "--json") == 0) { json = 1; b = NULL; }
+            else if (a && strcmp(a, "--json") == 0) { json = 1; a = b; b = NULL; }
+            if (b || extra) { fprintf(fs_output(), "layout: usage is layout [<path>] [--json]\n"); return 0; }
+            _layout(a ? a : ".", json);
+        }
+        // scrub
+        else if (strcmp(cmd, "scrub") == 0) {
+            if (check_arity("scrub", strtok_r(NULL, " ", &save) ? 2 : 1, 1) == -1) return 0;
+            scrub();
+        }
+        // sync
+        else if (strcmp(cmd, "sync") == 0) {
+            if (check_arity("sync", strtok_r(NULL, " ", &save) ? 2 : 1, 1) == -1) return 0;
+            sync_fs();
+        }
+        // writeback
+        else if (strcmp(cmd, "writeback") == 0) {
+            char* a = strtok_r(NULL, " ", &save);
+            char* b = strtok_r(NULL, " ", &save);
+            char* extra = strtok_r(NULL, " ", &save);
+            if (extra) { fprintf(fs_output(), "writeback: usage is writeback [<ms> [<KB>]]\n"); return 0; }
+            int ms = a ? atoi(a) : -1;
+            int kb = b ? atoi(b) : -1;
+            if ((a && (ms < 0 || (ms == 0 && strcmp(a, "0") != 0))) || (b && kb <= 0)) {
+                fprintf(fs_output(), "writeback: <ms> must be a non negative integer and <KB> a positive one\n");
+                return 0;
             }
+            writeback_set(ms, kb);
+        }
+
+        // If the command is unknown
+        else fprintf(fs_output(), "Command not recognised, type 'help' for command list.\n");
+    }
+
+    return 0;
+}
 
-            // If the command is unknown
-            else printf("Command not recognised, type 'help' for command list.\n");
+// Shell loop
+int main(int argc, char** argv) {
+    char line[MAX_LINE];
+
+    // Replay mode: shell --replay <trace> <file_system> [--paced] [open options]
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+        if (argc < 4) {
+            printf("usage: %s --replay <trace> <file_system> [--paced] [--backend <name>] [--window <MB>] [--cache <MB>] [--direct]\n", argv[0]);
+            return 1;
         }
+        int paced = argc > 4 && strcmp(argv[4], "--paced") == 0;
+        const Backend* backend;
+        BackendOptions options;
+        if (parse_open_options("replay", argv + 4 + paced, argc - 4 - paced, &backend, &options) == -1) return 1;
+        return replay(argv[2], argv[3], paced, backend, &options);
     }
 
-    // Clean FS closing
-    if (fs_open) 
-        close_fs();
+    // Server mode: shell --serve <file_system> <socket> [open options]
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        if (argc < 4) {
+            printf("usage: %s --serve <file_system> <socket> [--backend <name>] [--window <MB>] [--cache <MB>] [--direct]\n", argv[0]);
+            return 1;
+        }
+        const Backend* backend;
+        BackendOptions options;
+        if (parse_open_options("serve", argv + 4, argc - 4, &backend, &options) == -1) return 1;
+        return serve(argv[2], argv[3], backend, &options);
+    }
+
+    // Client mode: shell --connect <socket>
+    if (argc > 1 && strcmp(argv[1], "--connect") == 0) {
+        if (argc != 3) {
+            printf("usage: %s --connect <socket>\n", argv[0]);
+            return 1;
+        }
+        return client(argv[2]);
+    }
+
+    printf("Mini‑shell FAT – type 'help' to list commands, 'quit' to shutdown.\n");
+
+    while (1) {
+        if(!fs_open) printf("fs> ");
+        else{
+            printf("fs@%s:",filename);
+            print_path();
+        }
+
+        if (!fgets(line, sizeof(line), stdin)) {        // EOF (Ctrl‑D)
+            putchar('\n');
+            break;
+        }
+        // Removes final newline
+        line[strcspn(line, "\n")] = 0;
+
+        // Ignores empty lines or lines just made of spaces
+        if (strspn(line, " \t") == strlen(line)) continue;
+
+        if (trace_file) trace_record(line);
+        int quit = run_command(line);
+        if (fs_open) fs_release();      // cluster pointers from this command are not needed anymore
+        if (quit) break;
+    }
+
+    if (trace_file)
+        fclose(trace_file);
+
+    // Clean FS closing, all of them
+    unmount_all();
+    follow_active_mount();
 
     printf("Bye!\n");
     return 0;